@@ -1,8 +1,11 @@
 #include <fstream>
 #include <functional>
+#include <iterator>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <unordered_map>
+#include <set>
 #include <stack>
 #include <string>
 #include <utility>
@@ -10,22 +13,62 @@
 #include <sstream>
 #include <memory>
 #include <cmath>
-
-std::string ToString(double d)
+#include <limits>
+#include <exception>
+#include <cstdlib>
+#include <new>
+#include <deque>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <charconv>
+#include <string_view>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KSCRIPT_HAS_MMAP 1
+#endif
+// Build with -DKSCRIPT_TRACING=0 to compile the trace points out entirely
+#ifndef KSCRIPT_TRACING
+#define KSCRIPT_TRACING 1
+#endif
+
+// Every heap allocation made by the current thread, used by --count-allocations
+thread_local std::size_t t_allocationCount = 0;
+
+void* operator new(std::size_t size)
 {
-	std::ostringstream oss;
-	oss << std::setprecision(8) << std::noshowpoint << d;
-	std::string str = oss.str();
-	return str;
+	++t_allocationCount;
+	if (auto* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
 }
 
-bool IsEmptyString(const std::string& str)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+// operator new above is malloc based, which GCC can't tell once the two get inlined into each other
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept
 {
-	return str.empty() || str == "\n" || str == "\r" || str == "\r\n";
+	std::free(ptr);
 }
 
-class OperandToken;
-class Operation;
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 
 class ParseError : public std::runtime_error
 {
@@ -37,1414 +80,7167 @@ public:
 	}
 };
 
-class Variable
+// Same output as an ostream with setprecision(8) but without allocating; returns the number of characters written
+std::size_t FormatNumber(double d, char (&buffer)[32])
 {
-public:
-	std::string name;
-
-	explicit Variable(std::string name)
-		: name(std::move(name))
-	{}
+	const auto length = std::snprintf(buffer, sizeof buffer, "%.8g", d);
+	return length > 0 ? static_cast<std::size_t>(length) : 0;
+}
 
-	virtual ~Variable() = default;
-};
+std::string ToString(double d)
+{
+	char buffer[32];
+	return std::string(buffer, FormatNumber(d, buffer));
+}
 
-class NumericVariable : public Variable
+// Where the interpreter's pools and string buffers get their memory from. A host can plug in its own allocator,
+// e.g. one with per-thread arenas, before the first script runs.
+class HostAllocator
 {
 public:
-	double data = 0;
-
-	explicit NumericVariable(std::string name, double data)
-		: Variable(std::move(name)), data(data)
-	{
-	}
+	virtual ~HostAllocator() = default;
+	virtual void* Allocate(std::size_t size) = 0;
+	virtual void Deallocate(void* ptr, std::size_t size) = 0;
 };
 
-class StringVariable : public Variable
+class DefaultHostAllocator : public HostAllocator
 {
 public:
-	std::string data;
+	void* Allocate(std::size_t size) override
+	{
+		return ::operator new(size);
+	}
 
-	explicit StringVariable(std::string name, std::string data)
-		: Variable(std::move(name)), data(std::move(data))
+	void Deallocate(void* ptr, std::size_t) override
 	{
+		::operator delete(ptr);
 	}
 };
 
-class Token
+// Recycles small blocks per thread so that short-lived values don't go back to the host allocator; larger
+// requests go to it directly
+class BlockPool
 {
 public:
-	virtual ~Token() = default;
-	virtual std::string ToString() = 0;
-};
+	static constexpr std::size_t GRANULARITY = 16;
+	static constexpr std::size_t MAX_BLOCK_SIZE = 256;
 
-class OperandToken : public Token
-{
-public:
-	virtual ~OperandToken() = default;
-};
+	// Only possible before the pools handed out any memory, which then has to go back to the same allocator
+	static bool SetHostAllocator(HostAllocator* allocator)
+	{
+		if (hostAllocatorUsed.load())
+			return false;
+		hostAllocator.store(allocator);
+		return true;
+	}
 
-class NumericToken : public OperandToken
-{
-public:
+	static void* Allocate(std::size_t size)
+	{
+		if (size > MAX_BLOCK_SIZE)
+			return GetHostAllocator().Allocate(size);
+		if (isTornDown)
+			return GetHostAllocator().Allocate(RoundUp(size));
+		auto& head = Lists().heads[SizeClass(size)];
+		if (auto* block = head)
+		{
+			head = block->next;
+			return block;
+		}
+		return GetHostAllocator().Allocate(RoundUp(size));
+	}
 
-	std::string ToString() override
+	static void Deallocate(void* ptr, std::size_t size)
 	{
-		return ::ToString(Value());
+		if (size > MAX_BLOCK_SIZE)
+		{
+			GetHostAllocator().Deallocate(ptr, size);
+			return;
+		}
+		if (isTornDown)
+		{
+			GetHostAllocator().Deallocate(ptr, RoundUp(size));
+			return;
+		}
+		auto& head = Lists().heads[SizeClass(size)];
+		auto* block = static_cast<FreeBlock*>(ptr);
+		block->next = head;
+		head = block;
 	}
 
-	virtual double Value() = 0;
-};
+private:
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
 
-class VariableToken 
-{
-public:
-	virtual Variable* GetVariable() = 0;
-};
+	struct FreeLists
+	{
+		FreeBlock* heads[MAX_BLOCK_SIZE / GRANULARITY] = {};
 
-class NumericVariableToken : public NumericToken, public VariableToken
-{
-public:
-	NumericVariable* variable;
+		~FreeLists()
+		{
+			isTornDown = true;
+			for (auto sizeClass = 0u; sizeClass < MAX_BLOCK_SIZE / GRANULARITY; ++sizeClass)
+			{
+				for (auto* head = heads[sizeClass]; head;)
+				{
+					auto* next = head->next;
+					GetHostAllocator().Deallocate(head, (sizeClass + 1) * GRANULARITY);
+					head = next;
+				}
+			}
+		}
+	};
 
-	explicit NumericVariableToken(NumericVariable* variable)
-		: variable(variable)
-	{
-	}
+	static inline DefaultHostAllocator defaultHostAllocator;
+	static inline std::atomic<HostAllocator*> hostAllocator{&defaultHostAllocator};
+	static inline std::atomic<bool> hostAllocatorUsed{false};
+	// Set once this thread's lists are gone; static objects destroyed after them, e.g. on the main thread at exit,
+	// still free blocks, which then go straight to the host allocator. Trivially destructible, so it outlives them.
+	static inline thread_local bool isTornDown = false;
 
-	std::string ToString() override
+	static HostAllocator& GetHostAllocator()
 	{
-		return ::ToString(variable->data);
+		// the flag is written once, so the store isn't repeated on every miss
+		if (!hostAllocatorUsed.load(std::memory_order_relaxed))
+			hostAllocatorUsed.store(true);
+		return *hostAllocator.load(std::memory_order_acquire);
 	}
 
-
-	Variable* GetVariable() override
+	static FreeLists& Lists()
 	{
-		return variable;
+		thread_local FreeLists lists;
+		return lists;
 	}
 
-
-	double Value() override
+	static std::size_t RoundUp(std::size_t size)
 	{
-		return variable->data;
+		return (size + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
 	}
-};
 
-class StringToken : public OperandToken
-{
-public:
-	std::string ToString() override
+	static std::size_t SizeClass(std::size_t size)
 	{
-		return Value();
+		return RoundUp(size) / GRANULARITY - 1;
 	}
-	virtual std::string& Value() = 0;
 };
 
-class StringVariableToken : public StringToken, public VariableToken
+template <typename T>
+class PoolAllocator
 {
 public:
-	StringVariable* variable;
+	using value_type = T;
 
-	explicit StringVariableToken(StringVariable* variable)
-		: variable(variable)
+	PoolAllocator() = default;
+
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>&)
 	{
 	}
 
-	std::string ToString() override
+	T* allocate(std::size_t n)
 	{
-		return variable->data;
+		return static_cast<T*>(BlockPool::Allocate(n * sizeof(T)));
 	}
 
-
-	Variable* GetVariable() override
+	void deallocate(T* ptr, std::size_t n)
 	{
-		return variable;
+		BlockPool::Deallocate(ptr, n * sizeof(T));
 	}
 
+	template <typename U>
+	bool operator==(const PoolAllocator<U>&) const
+	{
+		return true;
+	}
 
-	std::string& Value() override
+	template <typename U>
+	bool operator!=(const PoolAllocator<U>&) const
 	{
-		return variable->data;
+		return false;
 	}
 };
 
-
-class NumericConstantToken : public NumericToken
+template <typename T, typename... Args>
+std::shared_ptr<T> MakePooled(Args&&... args)
 {
+	return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+}
 
+// Bytes held by one script: its compiled code, variables, arrays and string buffers, checked against an optional
+// limit. Whatever is charged remembers the account and releases its bytes when freed, wherever that happens, so
+// the account itself lives on until its module has closed it and the last of those bytes is released.
+class MemoryAccount
+{
 public:
-	double value;
-
-	explicit NumericConstantToken(double value)
-		: value(value)
+	struct Closer
 	{
-	}
+		void operator()(MemoryAccount* account) const
+		{
+			account->Release(account->codeSize + OWNER_BYTES);
+		}
+	};
 
-	double Value() override
+	// 0 for no limit
+	void SetLimit(std::size_t bytes)
 	{
-		return value;
+		limit = bytes;
 	}
-};
-
-class StringConstantToken : public StringToken
-{
-public:
-	std::string value;
 
-	explicit StringConstantToken(std::string value)
-		: value(std::move(value))
+	std::size_t Limit() const
 	{
+		return limit;
 	}
 
-	std::string& Value() override
+	std::size_t Used() const
 	{
-		return value;
+		return used.load(std::memory_order_relaxed) - OWNER_BYTES;
 	}
-};
 
-class OperatorOrFunction
-{
-public:
-	int precedence;
-
-	virtual ~OperatorOrFunction() = default;
-	
-	explicit OperatorOrFunction(int precedence)
-		: precedence(precedence)
+	std::size_t Peak() const
 	{
+		return peak.load(std::memory_order_relaxed) - OWNER_BYTES;
 	}
 
-	bool Precedes(OperatorOrFunction* other) const;
-};
-
-class Operator : public OperatorOrFunction
-{
-
-public:
-	Operator(std::string operator_, int precedence, int numOperands)
-		: operator_(std::move(operator_)),
-		OperatorOrFunction(precedence), numOperands(0)
+	void Charge(std::size_t bytes)
 	{
+		const auto total = used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+		if (limit && total - OWNER_BYTES > limit)
+		{
+			used.fetch_sub(bytes, std::memory_order_relaxed);
+			throw ParseError("Memory limit of " + std::to_string(limit) + " bytes exceeded");
+		}
+		auto highest = peak.load(std::memory_order_relaxed);
+		while (total > highest && !peak.compare_exchange_weak(highest, total, std::memory_order_relaxed))
+		{
+		}
 	}
-	std::size_t numOperands;
-	std::string operator_;
-};
-
-class OperatorOrFunctionCallToken : public Token
-{
-public:
-	OperatorOrFunction* value;
 
-	explicit OperatorOrFunctionCallToken(OperatorOrFunction* value)
-		: value(value)
+	void Release(std::size_t bytes)
 	{
+		if (used.fetch_sub(bytes, std::memory_order_acq_rel) == bytes)
+			delete this;
 	}
-};
-
-class OperatorToken : public OperatorOrFunctionCallToken
-{
-public:
 
-	explicit OperatorToken(Operator* value)
-		: OperatorOrFunctionCallToken(value)
+	// The compiled code the module runs, held until the module closes the account
+	void ChargeCode(std::size_t bytes)
 	{
+		Charge(bytes);
+		codeSize += bytes;
 	}
 
-	std::string ToString() override
+	// The account of the script running on this thread, which new values are charged to; null outside of scripts
+	static MemoryAccount* Active()
 	{
-		return Value()->operator_;
+		return active;
 	}
 
-	Operator* Value()
+	static void SetActive(MemoryAccount* account)
 	{
-		return dynamic_cast<Operator*>(value);
+		active = account;
 	}
-};
 
-class Operation
-{
+private:
+	// held by the owning module, so that the count only drops to zero once the module is gone
+	static constexpr std::size_t OWNER_BYTES = 1;
+
+	std::atomic<std::size_t> used{OWNER_BYTES};
+	std::atomic<std::size_t> peak{OWNER_BYTES};
+	std::size_t limit = 0;
+	std::size_t codeSize = 0;
+
+	static inline thread_local MemoryAccount* active = nullptr;
 };
 
-class SingleOperandOperation : public Operation
+bool IsEmptyString(const std::string& str)
 {
-public:
-	virtual std::shared_ptr<OperandToken> Eval(OperandToken* a) = 0;
-};
+	return str.empty() || str == "\n" || str == "\r" || str == "\r\n";
+}
 
-class DualOperandOperation : public Operation
+std::string_view Trim(std::string_view str)
 {
-public:
-	virtual std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) = 0;
-};
+	while (!str.empty() && isspace(static_cast<unsigned char>(str.front())))
+		str.remove_prefix(1);
+	while (!str.empty() && isspace(static_cast<unsigned char>(str.back())))
+		str.remove_suffix(1);
+	return str;
+}
 
-class DualNumericsOperation : public DualOperandOperation
+// Non-throwing counterpart of std::stod; fails unless the whole string (ignoring surrounding whitespace) is a number
+bool ParseNumber(std::string_view str, double& result)
 {
-	virtual std::shared_ptr<NumericToken> EvalNumeric(NumericToken*, NumericToken*) = 0;
+	str = Trim(str);
+	if (!str.empty() && str.front() == '+')
+		str.remove_prefix(1);
+	if (str.empty())
+		return false;
+	const auto parsed = std::from_chars(str.data(), str.data() + str.size(), result);
+	return parsed.ec == std::errc() && parsed.ptr == str.data() + str.size();
+}
 
-public:
+const std::uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
 
-	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) override
+std::uint64_t HashString(std::string_view str, std::uint64_t hash = FNV_OFFSET_BASIS)
+{
+	for (const auto ch : str)
 	{
-		NumericToken* _a, *_b;
-		if (((_a = dynamic_cast<NumericToken*>(a))) && ((_b = dynamic_cast<NumericToken*>(b))))
-		{
-			return EvalNumeric(_a, _b);
-		}
-		return nullptr;
+		hash ^= static_cast<unsigned char>(ch);
+		hash *= 1099511628211ull;
 	}
-};
-
-std::shared_ptr<StringToken> MakeString(const std::string& str)
-{
-	return std::make_shared<StringConstantToken>(str);
+	return hash;
 }
 
-class DualStringOperation : public DualOperandOperation
+// String representation used by tokens and variables. Up to INLINE_CAPACITY characters are stored in the value
+// itself; longer strings live in a reference-counted buffer that copies share, so assigning or passing a string
+// never copies its characters. A heap value is the first `length` characters of its buffer, and those never change
+// once written: appending to a value that ends where the buffer's used part ends writes behind it in place, anything
+// else copies first.
+class StringValue
 {
-	virtual std::shared_ptr<StringToken> EvalString(StringToken*, StringToken*) = 0;
-
 public:
+	static constexpr std::size_t INLINE_CAPACITY = 31;
 
-	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) override
+	StringValue()
 	{
-		std::string str1;
-		std::string str2;
-		if (auto* _a = dynamic_cast<StringToken*>(a))
-		{
-			str1 = _a->Value();
-		}
-		else if (auto* _a = dynamic_cast<NumericToken*>(a))
-		{
-			str1 = ToString(_a->Value());
-		}
+		Tag() = 0;
+	}
+
+	// memcpy of the characters; an empty string_view may have a null data(), which memcpy doesn't accept
+	static void CopyChars(char* to, std::string_view from)
+	{
+		if (!from.empty())
+			std::memcpy(to, from.data(), from.size());
+	}
 
-		if (auto* _b = dynamic_cast<StringToken*>(b))
+	StringValue(std::string_view str)
+	{
+		if (str.size() <= INLINE_CAPACITY)
 		{
-			str2 = _b->Value();
+			CopyChars(storage, str);
+			Tag() = static_cast<unsigned char>(str.size());
 		}
-		else if (auto* _b = dynamic_cast<NumericToken*>(b))
+		else
 		{
-			str2 = ToString(_b->Value());
+			auto* buffer = Buffer::Create(str.size(), str.size());
+			std::memcpy(buffer->Data(), str.data(), str.size());
+			SetBuffer(buffer, str.size());
 		}
-		return MakeString(str1 + str2);
 	}
-};
 
-class SingleNumericOperation : public SingleOperandOperation
-{
-	virtual std::shared_ptr<NumericToken> EvalNumeric(NumericToken*) = 0;
+	StringValue(const std::string& str)
+		: StringValue(std::string_view(str))
+	{
+	}
 
-public:
+	StringValue(const char* str)
+		: StringValue(std::string_view(str))
+	{
+	}
 
-	std::shared_ptr<OperandToken> Eval(OperandToken* a) override
+	StringValue(const StringValue& other)
 	{
-		if (auto* token = dynamic_cast<NumericToken*>(a))
-		{
-			return EvalNumeric(token);
-		}
-		return nullptr;
+		std::memcpy(storage, other.storage, sizeof storage);
+		if (!IsInline())
+			GetBuffer()->refCount.fetch_add(1, std::memory_order_relaxed);
 	}
-};
 
-class SingleOperandOperator : public Operator
-{
-public:
-	std::vector<SingleOperandOperation*> operations;
+	StringValue(StringValue&& other) noexcept
+	{
+		std::memcpy(storage, other.storage, sizeof storage);
+		other.Tag() = 0;
+	}
 
-	SingleOperandOperator(const std::string& operator_, int precedence,
-		std::vector<SingleOperandOperation*> operations={})
-		: Operator(operator_, precedence, 1), operations(std::move(operations))
+	StringValue& operator=(StringValue other) noexcept
 	{
+		std::swap(storage, other.storage);
+		return *this;
 	}
 
-	std::shared_ptr<OperandToken> Eval(OperandToken* token)
+	~StringValue()
 	{
-		for (auto& operation : operations)
+		if (!IsInline())
 		{
-			if (auto result = operation->Eval(token)) return result;
+			auto* buffer = GetBuffer();
+			if (buffer->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				Buffer::Destroy(buffer);
 		}
-		return nullptr;
 	}
-};
 
-class DualOperandOperator : public Operator
-{
-public:
-	std::vector<DualOperandOperation*> operations;
+	std::string_view View() const
+	{
+		if (!IsInline())
+			return std::string_view(GetBuffer()->Data(), GetLength());
+		return std::string_view(storage, Tag());
+	}
 
-	DualOperandOperator(const std::string& operator_, int precedence,
-		std::vector<DualOperandOperation*> operations={})
-		: Operator(operator_, precedence, 2), operations(std::move(operations))
+	std::size_t Size() const
 	{
+		return IsInline() ? Tag() : GetLength();
 	}
 
-	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b)
+	bool IsInline() const
 	{
-		for (auto& operation : operations)
-		{
-			if (auto result = operation->Eval(a, b))
+		return Tag() != HEAP_TAG;
+	}
+
+	// Allocates at most once, and only if the result doesn't fit inline
+	static StringValue Concat(std::string_view a, std::string_view b)
+	{
+		StringValue result;
+		const auto size = a.size() + b.size();
+		char* data = result.storage;
+		if (size <= INLINE_CAPACITY)
+		{
+			result.Tag() = static_cast<unsigned char>(size);
+		}
+		else
+		{
+			auto* buffer = Buffer::Create(size, size);
+			result.SetBuffer(buffer, size);
+			data = buffer->Data();
+		}
+		CopyChars(data, a);
+		CopyChars(data + a.size(), b);
+		return result;
+	}
+
+	// Like Concat, but extends a's buffer in place when a ends where the buffer's used part ends. A reallocated
+	// buffer gets room to spare so that repeated appends to the same string stay amortized O(appended length).
+	static StringValue Concat(const StringValue& a, std::string_view b)
+	{
+		if (a.IsInline())
+			return Concat(a.View(), b);
+		auto* buffer = a.GetBuffer();
+		const auto length = a.GetLength();
+		const auto size = length + b.size();
+		if (size <= buffer->capacity)
+		{
+			// the appended characters are charged before they take up the spare room
+			if (buffer->account)
+				buffer->account->Charge(b.size());
+			auto expected = length;
+			if (buffer->used.compare_exchange_strong(expected, size, std::memory_order_relaxed))
+			{
+				CopyChars(buffer->Data() + length, b);
+				buffer->refCount.fetch_add(1, std::memory_order_relaxed);
+				StringValue result;
+				result.SetBuffer(buffer, size);
 				return result;
+			}
+			if (buffer->account)
+				buffer->account->Release(b.size());
 		}
-		return nullptr;
+		auto* newBuffer = Buffer::Create(size, size * 2);
+		std::memcpy(newBuffer->Data(), buffer->Data(), length);
+		CopyChars(newBuffer->Data() + length, b);
+		StringValue result;
+		result.SetBuffer(newBuffer, size);
+		return result;
 	}
-};
 
-class ScriptLine
-{
-public:
-	std::vector<std::shared_ptr<Token>> tokens;
+	// Charges a heap buffer that was built outside of any script, on a background or worker thread, to the given
+	// account; buffers that are charged already are left alone
+	void ChargeTo(MemoryAccount* account)
+	{
+		if (IsInline() || !account)
+			return;
+		auto* buffer = GetBuffer();
+		if (buffer->account)
+			return;
+		account->Charge(sizeof(Buffer) + buffer->used.load(std::memory_order_relaxed));
+		buffer->account = account;
+	}
 
-	explicit ScriptLine(std::vector<std::shared_ptr<Token>> tokens)
-		: tokens(std::move(tokens))
+private:
+	static constexpr unsigned char HEAP_TAG = 0xFF;
+
+	// header of a heap string, the characters follow right after it
+	struct Buffer
+	{
+		std::atomic<std::size_t> refCount;
+		// characters written so far; a value sharing the buffer may only append if it ends exactly here
+		std::atomic<std::size_t> used;
+		std::size_t capacity;
+		MemoryAccount* account;
+
+		char* Data()
+		{
+			return reinterpret_cast<char*>(this + 1);
+		}
+
+		// The account is charged for the characters in use, not for the room kept for appending; those are charged as
+		// appends fill it
+		static Buffer* Create(std::size_t used, std::size_t capacity)
+		{
+			// charged first, so that a string over the limit is never allocated
+			auto* account = MemoryAccount::Active();
+			if (account)
+				account->Charge(sizeof(Buffer) + used);
+			auto* buffer = static_cast<Buffer*>(BlockPool::Allocate(sizeof(Buffer) + capacity));
+			new (&buffer->refCount) std::atomic<std::size_t>(1);
+			new (&buffer->used) std::atomic<std::size_t>(used);
+			buffer->capacity = capacity;
+			buffer->account = account;
+			return buffer;
+		}
+
+		static void Destroy(Buffer* buffer)
+		{
+			const auto size = sizeof(Buffer) + buffer->capacity;
+			const auto charged = sizeof(Buffer) + buffer->used.load(std::memory_order_relaxed);
+			auto* account = buffer->account;
+			buffer->refCount.~atomic();
+			buffer->used.~atomic();
+			BlockPool::Deallocate(buffer, size);
+			if (account)
+				account->Release(charged);
+		}
+	};
+
+	// inline characters, or the buffer pointer followed by the length; the last byte is the inline length or HEAP_TAG
+	alignas(Buffer*) char storage[INLINE_CAPACITY + 1];
+
+	unsigned char& Tag()
 	{
+		return reinterpret_cast<unsigned char&>(storage[INLINE_CAPACITY]);
 	}
-};
 
-class ScriptModule;
+	unsigned char Tag() const
+	{
+		return static_cast<unsigned char>(storage[INLINE_CAPACITY]);
+	}
 
-class NestedBeginDeclaration
-{
-public:
-	std::string name;
-	std::size_t line;
-	std::function<void(ScriptModule&)> onEnd;
+	Buffer* GetBuffer() const
+	{
+		Buffer* buffer;
+		std::memcpy(&buffer, storage, sizeof buffer);
+		return buffer;
+	}
 
-	NestedBeginDeclaration(const std::string& name, std::size_t line)
-		: name(name),
-		  line(line)
+	std::size_t GetLength() const
+	{
+		std::size_t length;
+		std::memcpy(&length, storage + sizeof(Buffer*), sizeof length);
+		return length;
+	}
+
+	void SetBuffer(Buffer* buffer, std::size_t length)
 	{
+		std::memcpy(storage, &buffer, sizeof buffer);
+		std::memcpy(storage + sizeof(Buffer*), &length, sizeof length);
+		Tag() = HEAP_TAG;
 	}
 };
 
-class ScriptModule;
+static_assert(sizeof(StringValue) == 32, "StringValue should fill exactly one 32 byte slot");
 
-class EndToBegin
+class OperandToken;
+class Operation;
+
+class Variable
 {
 public:
-	int lineNumber = 0;
-	std::function<void(ScriptModule&)> execute;
+	std::string name;
+	// created on first lookup and handed out for every later reference to the variable
+	std::shared_ptr<OperandToken> token;
 
-	EndToBegin(int lineNumber, std::function<void(ScriptModule&)> execute)
-		: lineNumber(lineNumber),
-		  execute(std::move(execute))
+	// the object with its token, name and place in the variable map, as charged to the script's memory account
+	static constexpr std::size_t FOOTPRINT = 192;
+
+	explicit Variable(std::string name)
+		: name(std::move(name))
 	{
+		Charge(FOOTPRINT + this->name.size());
 	}
 
-	explicit EndToBegin(int lineNumber)
-		: lineNumber(lineNumber)
+	virtual ~Variable()
 	{
+		if (account)
+			account->Release(chargedBytes);
 	}
 
+	Variable(const Variable&) = delete;
+	Variable& operator=(const Variable&) = delete;
 
-	EndToBegin() = default;
+protected:
+	void Charge(std::size_t bytes)
+	{
+		if (!account)
+			account = MemoryAccount::Active();
+		if (!account)
+			return;
+		account->Charge(bytes);
+		chargedBytes += bytes;
+	}
+
+private:
+	MemoryAccount* account = nullptr;
+	std::size_t chargedBytes = 0;
 };
 
-class ScriptModule
+class NumericVariable : public Variable
 {
 public:
+	double data = 0;
 
-	explicit ScriptModule(std::vector<std::string> scriptCompileLines)
-		: scriptCompileLines(std::move(scriptCompileLines))
+	explicit NumericVariable(std::string name, double data)
+		: Variable(std::move(name)), data(data)
 	{
 	}
+};
 
-	ScriptModule() = default;
-	
-	std::vector<std::string> scriptCompileLines;
-	std::vector<ScriptLine> scriptRunLines;
-	std::vector<std::string>::iterator* curCompileLineIter = nullptr;
-	std::vector<ScriptLine>::iterator* curRunLineIter = nullptr;
-	std::map<std::string, std::shared_ptr<Variable>> scriptVariables;
-	std::stack<NestedBeginDeclaration> nestStack;
-	std::map<int, int> beginToEndMap;
-	std::map<int, EndToBegin> endToBeginMap;
-	std::stack<bool> ifResultStack;
+class StringVariable : public Variable
+{
+public:
+	StringValue data;
 
-	bool Compile();
-	void Execute();
-	std::size_t GetCurrentCompileLine()
+	explicit StringVariable(std::string name, StringValue data)
+		: Variable(std::move(name)), data(std::move(data))
 	{
-		return *curCompileLineIter - scriptCompileLines.begin();
 	}
-	std::size_t GetCurrentRunLine()
+};
+
+// A column of values; numeric unless any of its cells failed to parse as a number
+class ArrayVariable : public Variable
+{
+public:
+	std::vector<double> numbers;
+	std::vector<StringValue> strings;
+	bool isNumeric = true;
+
+	explicit ArrayVariable(std::string name)
+		: Variable(std::move(name))
 	{
-		return *curRunLineIter - scriptRunLines.begin();
 	}
 
-	void GoToLine(int line)
+	std::size_t Size() const
 	{
-		if (line > 0)
-			*curRunLineIter = scriptRunLines.begin() + (line - 1);
+		return isNumeric ? numbers.size() : strings.size();
+	}
+
+	// Charges the elements once the array is filled; long strings are charged by their buffers, including those
+	// that were parsed on worker threads
+	void ChargeElements()
+	{
+		Charge(numbers.capacity() * sizeof(double) + strings.capacity() * sizeof(StringValue));
+		for (auto& str : strings)
+			str.ChargeTo(MemoryAccount::Active());
 	}
 };
 
-ScriptModule s_scriptModule;
+class Token
+{
+public:
+	virtual ~Token() = default;
+	virtual std::string ToString() = 0;
+};
 
-class AssignVariableOperation : public DualOperandOperation
+class OperandToken : public Token
 {
 public:
-	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) override
+	virtual ~OperandToken() = default;
+};
+
+class NumericToken : public OperandToken
+{
+public:
+
+	std::string ToString() override
 	{
-		std::string varName;
-		if (auto* varNameToken = dynamic_cast<StringConstantToken*>(a))
-		{
-			varName = varNameToken->ToString();
-		}
-		else if (auto* varToken = dynamic_cast<VariableToken*>(a))
-		{
-			varName = varToken->GetVariable()->name;
-		}
-		if (!varName.empty())
-		{
-			if (auto* numericToken = dynamic_cast<NumericToken*>(b))
-			{
-				s_scriptModule.scriptVariables[varName] = std::make_shared<NumericVariable>(varName, numericToken->Value());
-				return std::make_shared<NumericVariableToken>(dynamic_cast<NumericVariable*>(s_scriptModule.scriptVariables[varName].get()));
-			}
-			if (auto* stringToken = dynamic_cast<StringToken*>(b))
-			{
-				s_scriptModule.scriptVariables[varName] = std::make_shared<StringVariable>(varName, stringToken->Value());
-				return std::make_shared<StringVariableToken>(dynamic_cast<StringVariable*>(s_scriptModule.scriptVariables[varName].get()));
-			}
-		}
-		return nullptr;
+		return ::ToString(Value());
 	}
+
+	virtual double Value() = 0;
 };
 
-inline std::shared_ptr<NumericToken> Numeric(double x)
+class VariableToken 
 {
-	return std::make_shared<NumericConstantToken>(x);
-}
+public:
+	virtual Variable* GetVariable() = 0;
+};
 
-class LogicalOrOperation : public DualNumericsOperation
+class NumericVariableToken : public NumericToken, public VariableToken
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+public:
+	NumericVariable* variable;
+
+	explicit NumericVariableToken(NumericVariable* variable)
+		: variable(variable)
 	{
-		return Numeric(a->Value() || b->Value());
 	}
-};
 
-class LogicalAndOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	std::string ToString() override
 	{
-		return Numeric(a->Value() && b->Value());
+		return ::ToString(variable->data);
 	}
-};
 
-bool DoubleEquals(double a, double b)
-{
-	const auto EPSILON = 0.0001;
-	const auto diff = a - b;
-	return diff < EPSILON && -diff < EPSILON;
-}
 
-class EqualsOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	Variable* GetVariable() override
 	{
-		return Numeric(DoubleEquals(a->Value(), b->Value()));
+		return variable;
 	}
-};
 
-class NotEqualsOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+
+	double Value() override
 	{
-		return Numeric(!DoubleEquals(a->Value(), b->Value()));
+		return variable->data;
 	}
 };
 
-class GTOperation : public DualNumericsOperation
+class StringToken : public OperandToken
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+public:
+	std::string ToString() override
+	{
+		return std::string(View());
+	}
+
+	// Copying the returned value shares its storage
+	virtual const StringValue& Value() = 0;
+
+	virtual std::string_view View()
 	{
-		return Numeric(a->Value() > b->Value());
+		return Value().View();
 	}
 };
 
-class GTEOperation : public DualNumericsOperation
+class StringVariableToken : public StringToken, public VariableToken
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+public:
+	StringVariable* variable;
+
+	explicit StringVariableToken(StringVariable* variable)
+		: variable(variable)
 	{
-		return Numeric(a->Value() >= b->Value());
 	}
-};
 
+	std::string ToString() override
+	{
+		return std::string(variable->data.View());
+	}
 
-class LTOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+
+	Variable* GetVariable() override
 	{
-		return Numeric(a->Value() < b->Value());
+		return variable;
 	}
-};
 
-class LTEOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+
+	const StringValue& Value() override
 	{
-		return Numeric(a->Value() <= b->Value());
+		return variable->data;
 	}
 };
 
-class BitwiseAndOperation : public DualNumericsOperation
+
+class ArrayVariableToken : public OperandToken, public VariableToken
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+public:
+	ArrayVariable* variable;
+
+	explicit ArrayVariableToken(ArrayVariable* variable)
+		: variable(variable)
 	{
-		return Numeric(static_cast<int>(a->Value()) & static_cast<int>(b->Value()));
 	}
-};
 
-class BitwiseOrOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	std::string ToString() override
 	{
-		return Numeric(static_cast<int>(a->Value()) | static_cast<int>(b->Value()));
+		return "array(" + std::to_string(variable->Size()) + ")";
 	}
-};
 
-class LeftShiftOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	Variable* GetVariable() override
 	{
-		return Numeric(static_cast<int64_t>(a->Value()) << static_cast<int>(b->Value()));
+		return variable;
 	}
 };
 
-class RightShiftOperation : public DualNumericsOperation
+// Operands that a compiled line or a variable already owns are handed through evaluation as borrowed shared_ptrs,
+// which have no control block: copying one is a plain pointer copy rather than an atomic increment. A borrowed
+// operand is valid until its line finishes; whatever keeps one longer takes it through Retain().
+std::shared_ptr<OperandToken> Borrow(OperandToken* token)
+{
+	return std::shared_ptr<OperandToken>(std::shared_ptr<OperandToken>(), token);
+}
+
+bool IsBorrowed(const std::shared_ptr<OperandToken>& token)
+{
+	return token && token.use_count() == 0;
+}
+
+const std::shared_ptr<OperandToken>& GetVariableToken(Variable* variable)
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	if (!variable->token)
 	{
-		return Numeric(static_cast<int>(a->Value()) >> static_cast<int>(b->Value()));
+		if (auto* numVar = dynamic_cast<NumericVariable*>(variable))
+			variable->token = MakePooled<NumericVariableToken>(numVar);
+		else if (auto* strVar = dynamic_cast<StringVariable*>(variable))
+			variable->token = MakePooled<StringVariableToken>(strVar);
+		else if (auto* arrayVar = dynamic_cast<ArrayVariable*>(variable))
+			variable->token = MakePooled<ArrayVariableToken>(arrayVar);
 	}
-};
+	return variable->token;
+}
 
-class MultiplyOperation : public DualNumericsOperation
+class NumericConstantToken : public NumericToken
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+
+public:
+	double value;
+
+	explicit NumericConstantToken(double value)
+		: value(value)
 	{
-		return Numeric(a->Value() * b->Value());
 	}
-};
 
-class AddOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	double Value() override
 	{
-		return Numeric(a->Value() + b->Value());
+		return value;
 	}
 };
 
-class StringAddOperation : public DualStringOperation
+class StringConstantToken : public StringToken
 {
-	std::shared_ptr<StringToken> EvalString(StringToken* a, StringToken* b) override
+public:
+	StringValue value;
+
+	explicit StringConstantToken(StringValue value)
+		: value(std::move(value))
 	{
-		return std::make_shared<StringConstantToken>(a->Value() + b->Value());
 	}
-};
 
-class SubtractOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	const StringValue& Value() override
 	{
-		return Numeric(a->Value() - b->Value());
+		return value;
 	}
 };
 
-class DivideOperation : public DualNumericsOperation
+// Refers to characters owned by someone else (e.g. the input buffer); copied into
+// its own storage only when the value has to outlive its source.
+class StringViewToken : public StringToken
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+public:
+	std::string_view view;
+	StringValue materialized;
+	bool isMaterialized = false;
+
+	explicit StringViewToken(std::string_view view)
+		: view(view)
 	{
-		if (b->Value() == 0)
-		{
-			throw ParseError("Division by zero");
-		}
-		return Numeric(a->Value() / b->Value());
 	}
-};
 
-class ModuloOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	const StringValue& Value() override
 	{
-		if (b->Value() == 0)
-		{
-			throw ParseError("Modulo by zero");
-		}
-		return Numeric(static_cast<int>(a->Value()) % static_cast<int>(b->Value()));
+		Materialize();
+		return materialized;
 	}
-};
 
-class PowOperation : public DualNumericsOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* a, NumericToken* b) override
+	std::string_view View() override
 	{
-		return Numeric(std::pow(a->Value(), b->Value()));
+		return view;
 	}
-};
 
-class NegateOperation : public SingleNumericOperation
-{
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* t) override
+	void Materialize()
 	{
-		return Numeric(-t->Value());
+		if (isMaterialized)
+			return;
+		materialized = StringValue(view);
+		view = materialized.View();
+		isMaterialized = true;
 	}
 };
 
-class LogicalNotOperation : public SingleNumericOperation
+class OperatorOrFunction
 {
-	std::shared_ptr<NumericToken> EvalNumeric(NumericToken* t) override
+public:
+	int precedence;
+
+	virtual ~OperatorOrFunction() = default;
+	
+	explicit OperatorOrFunction(int precedence)
+		: precedence(precedence)
 	{
-		return Numeric(!t->Value());
 	}
+
+	bool Precedes(OperatorOrFunction* other) const;
 };
 
-std::vector<Operator*> s_operators =
+class Operator : public OperatorOrFunction
 {
-	new DualOperandOperator("=", 2, {new AssignVariableOperation()}),
-	new DualOperandOperator("||", 5, {new LogicalOrOperation()}),
-	new DualOperandOperator("&&", 7, {new LogicalAndOperation()}),
-	new DualOperandOperator("==", 13, {new EqualsOperation()}),
-	new DualOperandOperator("!=", 15, {new NotEqualsOperation()}),
-	new DualOperandOperator(">", 15, {new GTOperation()}),
-	new DualOperandOperator("<", 15, {new LTOperation()}),
-	new DualOperandOperator(">=", 15, {new GTEOperation()}),
-	new DualOperandOperator("<=", 15, {new LTEOperation()}),
-	new DualOperandOperator("|", 16, {new BitwiseOrOperation()}),
-	new DualOperandOperator("&", 16, {new BitwiseAndOperation()}),
-	new DualOperandOperator("<<", 18, {new LeftShiftOperation()}),
-	new DualOperandOperator(">>", 18, {new RightShiftOperation()}),
-	new DualOperandOperator("+", 19, {new AddOperation(), new StringAddOperation()}),
-	new DualOperandOperator("-", 19, {new SubtractOperation()}),
-	new DualOperandOperator("*", 21, {new MultiplyOperation()}),
-	new DualOperandOperator("/", 21, {new DivideOperation()}),
-	new DualOperandOperator("%", 21, {new ModuloOperation()}),
-	new DualOperandOperator("^", 23, {new PowOperation()}),
-	new SingleOperandOperator("-", 25, {new NegateOperation()}),
-	new SingleOperandOperator("!", 27, {new LogicalNotOperation()}),
-	new Operator("(", 80, 0),
-	new Operator(")", 80, 0),
-};
-
-
 
-class Function : public OperatorOrFunction
-{
 public:
-	std::string name;
-	std::size_t numParams;
-
-	explicit Function(std::string name, std::size_t numParams)
-		: OperatorOrFunction(23), name(std::move(name)), numParams(numParams)
-	{
-	}
-
-	virtual double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) = 0;
-	virtual bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) { return true; };
-	
-	virtual void ValidateCompilation(ScriptModule& scriptModule)
+	Operator(std::string operator_, int precedence, int numOperands)
+		: operator_(std::move(operator_)),
+		OperatorOrFunction(precedence), numOperands(0)
 	{
 	}
+	std::size_t numOperands;
+	std::string operator_;
 };
 
-class NestedFunction : public Function
+class OperatorOrFunctionCallToken : public Token
 {
 public:
-	NestedFunction(const std::string& name, std::size_t numParams)
-		: Function(name, numParams)
-	{
-	}
+	OperatorOrFunction* value;
 
-	void ValidateCompilation(ScriptModule& scriptModule) override
+	explicit OperatorOrFunctionCallToken(OperatorOrFunction* value)
+		: value(value)
 	{
-		if (!scriptModule.curCompileLineIter)
-			throw ParseError("'" + name + "' cannot be called from the interactive interpreter");
-		scriptModule.nestStack.emplace(name, *scriptModule.curCompileLineIter - scriptModule.scriptCompileLines.begin());
 	}
 };
 
-class FunctionCallToken : public OperatorOrFunctionCallToken
+class OperatorToken : public OperatorOrFunctionCallToken
 {
 public:
 
-	explicit FunctionCallToken(Function* function) : OperatorOrFunctionCallToken(function)
+	explicit OperatorToken(Operator* value)
+		: OperatorOrFunctionCallToken(value)
 	{
 	}
 
-	Function* Value()
+	std::string ToString() override
 	{
-		return dynamic_cast<Function*>(value);
+		return Value()->operator_;
 	}
 
-	std::string ToString() override
+	Operator* Value()
 	{
-		return Value()->name;
+		return dynamic_cast<Operator*>(value);
 	}
 };
 
-class SqrtFunction : public Function
+class Operation
+{
+};
+
+class SingleOperandOperation : public Operation
 {
 public:
+	virtual std::shared_ptr<OperandToken> Eval(OperandToken* a) = 0;
+};
 
-	SqrtFunction() : Function("sqrt", 1){}
+class DualOperandOperation : public Operation
+{
+public:
+	virtual std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) = 0;
+};
 
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
-	{
-		auto param = std::dynamic_pointer_cast<NumericToken>(params.at(0));
-		return std::sqrt(param->Value());
-	}
+inline std::shared_ptr<NumericToken> Numeric(double x)
+{
+	return MakePooled<NumericConstantToken>(x);
+}
 
+class DualNumericsOperation : public DualOperandOperation
+{
+public:
+	// The operation on plain numbers, which compiled expressions call directly
+	virtual double Apply(double a, double b) const = 0;
+	// ... and on count numbers of each column at once
+	virtual void ApplyColumns(const double* a, const double* b, double* result, std::size_t count) const = 0;
 
-	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) override
 	{
-		return std::dynamic_pointer_cast<NumericToken>(params.at(0)).get();
+		NumericToken* _a, *_b;
+		if (((_a = dynamic_cast<NumericToken*>(a))) && ((_b = dynamic_cast<NumericToken*>(b))))
+		{
+			return Numeric(Apply(_a->Value(), _b->Value()));
+		}
+		return nullptr;
 	}
 };
 
-class PrintFunction : public Function
+// Implements both forms with the operation's static Compute, which the column loop inlines so the compiler can
+// vectorize it
+template <typename Derived>
+class DualNumericsOperationOf : public DualNumericsOperation
 {
 public:
-
-	PrintFunction() : Function("print", 1) {}
-
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	double Apply(double a, double b) const override
 	{
-		std::string toPrint;
-		if (auto strToken = std::dynamic_pointer_cast<StringToken>(params.at(0)))
-		{
-			toPrint = strToken->Value();
-		}
-		else if (auto numericToken = std::dynamic_pointer_cast<NumericToken>(params.at(0)))
-		{
-			toPrint = ToString(numericToken->Value());
-		}
-		std::cout << toPrint << std::endl;
-		return 1;
+		return Derived::Compute(a, b);
 	}
 
-	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	void ApplyColumns(const double* a, const double* b, double* result, std::size_t count) const override
 	{
-		return true;
+		for (std::size_t i = 0; i < count; ++i)
+			result[i] = Derived::Compute(a[i], b[i]);
 	}
 };
 
-class ConditionalFunction : public NestedFunction
+std::shared_ptr<StringToken> MakeString(StringValue str)
+{
+	return MakePooled<StringConstantToken>(std::move(str));
+}
+
+// An owning pointer to the same operand: variables hand out their own token, constants of the line are copied
+std::shared_ptr<OperandToken> Retain(std::shared_ptr<OperandToken> token)
+{
+	if (!IsBorrowed(token))
+		return token;
+	if (auto* variableToken = dynamic_cast<VariableToken*>(token.get()))
+		return GetVariableToken(variableToken->GetVariable());
+	if (auto* numericToken = dynamic_cast<NumericToken*>(token.get()))
+		return Numeric(numericToken->Value());
+	if (auto* stringToken = dynamic_cast<StringToken*>(token.get()))
+		return MakeString(stringToken->Value());
+	throw ParseError("Can't keep value " + token->ToString());
+}
+
+class StringAddOperation : public DualOperandOperation
 {
 public:
-	ConditionalFunction(const std::string& name)
-		: NestedFunction(name, 1)
+	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) override
 	{
+		char buffer[32];
+		const auto str2 = GetString(b, buffer);
+		// appending to a string value may reuse its buffer
+		if (auto* str = dynamic_cast<StringToken*>(a))
+			return MakeString(StringValue::Concat(str->Value(), str2));
+		char buffer1[32];
+		return MakeString(StringValue::Concat(GetString(a, buffer1), str2));
 	}
 
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+private:
+	static std::string_view GetString(OperandToken* token, char (&buffer)[32])
 	{
-		bool val = false;
-		if (auto numToken = std::dynamic_pointer_cast<NumericToken>(params.at(0)))
-		{
-			val = numToken->Value();
-			if (!val)
-			{
-				const auto line = scriptModule.beginToEndMap[scriptModule.GetCurrentRunLine()];
-				scriptModule.GoToLine(line);
-			}
-		}
-		scriptModule.ifResultStack.push(val);
-		return 0;
+		if (auto* str = dynamic_cast<StringToken*>(token))
+			return str->View();
+		if (auto* num = dynamic_cast<NumericToken*>(token))
+			return std::string_view(buffer, FormatNumber(num->Value(), buffer));
+		return {};
 	}
+};
 
-	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+class SingleNumericOperation : public SingleOperandOperation
+{
+public:
+	virtual double Apply(double a) const = 0;
+	virtual void ApplyColumn(const double* a, double* result, std::size_t count) const = 0;
+
+	std::shared_ptr<OperandToken> Eval(OperandToken* a) override
 	{
-		return std::dynamic_pointer_cast<NumericToken>(params.at(0)).get();
+		if (auto* token = dynamic_cast<NumericToken*>(a))
+		{
+			return Numeric(Apply(token->Value()));
+		}
+		return nullptr;
 	}
 };
 
-class IfFunction : public ConditionalFunction
+template <typename Derived>
+class SingleNumericOperationOf : public SingleNumericOperation
 {
 public:
+	double Apply(double a) const override
+	{
+		return Derived::Compute(a);
+	}
 
-	IfFunction() : ConditionalFunction("if"){}
+	void ApplyColumn(const double* a, double* result, std::size_t count) const override
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			result[i] = Derived::Compute(a[i]);
+	}
 };
 
-class ElseFunction : public Function
+class SingleOperandOperator : public Operator
 {
-
 public:
-	ElseFunction() : Function("else", 0) {}
+	std::vector<SingleOperandOperation*> operations;
 
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	SingleOperandOperator(const std::string& operator_, int precedence,
+		std::vector<SingleOperandOperation*> operations={})
+		: Operator(operator_, precedence, 1), operations(std::move(operations))
 	{
-		if (scriptModule.ifResultStack.empty())
-			throw ParseError("Error evaluating else statement (no if result detected)");
-		const auto ifResult = scriptModule.ifResultStack.top();
-		if (ifResult)
-		{
-			scriptModule.GoToLine(scriptModule.beginToEndMap[scriptModule.GetCurrentRunLine()]);
-		}
-		return 0;
 	}
-	
-	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override { return true;}
-	
-	void ValidateCompilation(ScriptModule& scriptModule) override
+
+	std::shared_ptr<OperandToken> Eval(OperandToken* token)
 	{
-		
-		if (scriptModule.nestStack.empty())
-		{
-			throw ParseError("Misplaced 'else' statement");
-		}
-		auto& top = scriptModule.nestStack.top();
-		if (top.name != "if" && top.name != "elseif")
+		for (auto& operation : operations)
 		{
-			throw ParseError("Missing 'if' for 'else' statement");
+			if (auto result = operation->Eval(token)) return result;
 		}
-		const auto curLine = scriptModule.GetCurrentCompileLine();
-		scriptModule.beginToEndMap[top.line] = curLine;
-		scriptModule.nestStack.pop();
-		scriptModule.nestStack.push(NestedBeginDeclaration("else", curLine));
+		return nullptr;
 	}
 };
 
-class ElseIfFunction : public Function
+class DualOperandOperator : public Operator
 {
-
 public:
-	ElseIfFunction() : Function("elseif", 1) {}
+	std::vector<DualOperandOperation*> operations;
 
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	DualOperandOperator(const std::string& operator_, int precedence,
+		std::vector<DualOperandOperation*> operations={})
+		: Operator(operator_, precedence, 2), operations(std::move(operations))
 	{
-		if (scriptModule.ifResultStack.empty())
-			throw ParseError("Error evaluating elseif statement (no if result detected)");
-		const auto ifResult = scriptModule.ifResultStack.top();
-		scriptModule.ifResultStack.pop();
-		const bool result = std::dynamic_pointer_cast<NumericToken>(params.at(0))->Value();
-		if (ifResult || !result)
-		{
-			scriptModule.GoToLine(scriptModule.beginToEndMap[scriptModule.GetCurrentRunLine()]);
-		}
-		if (ifResult)
-			scriptModule.ifResultStack.push(true);
-		else
-			scriptModule.ifResultStack.push(result);
-		return 0;
 	}
 
-	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override { return true; }
-
-	void ValidateCompilation(ScriptModule& scriptModule) override
+	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b)
 	{
-		if (scriptModule.nestStack.empty())
-		{
-			throw ParseError("Misplaced 'elseif' statement");
-		}
-		auto& top = scriptModule.nestStack.top();
-		if (top.name != "if" && top.name != "elseif")
+		for (auto& operation : operations)
 		{
-			throw ParseError("Missing 'if' for 'elseif' statement");
+			if (auto result = operation->Eval(a, b))
+				return result;
 		}
-		const auto curLine = scriptModule.GetCurrentCompileLine();
-		scriptModule.beginToEndMap[top.line] = curLine;
-		scriptModule.nestStack.pop();
-		scriptModule.nestStack.push(NestedBeginDeclaration("elseif", curLine));
+		return nullptr;
 	}
 };
 
-class WhileFunction : public ConditionalFunction
+// The tokens of one line as evaluated, without owning them
+class TokenRange
 {
 public:
+	TokenRange() = default;
 
-	WhileFunction() : ConditionalFunction("while") {}
+	TokenRange(std::vector<std::shared_ptr<Token>>& tokens)
+		: first(tokens.data()), last(tokens.data() + tokens.size())
+	{
+	}
 
-	void ValidateCompilation(ScriptModule& scriptModule) override
+	TokenRange(std::shared_ptr<Token>* first, std::shared_ptr<Token>* last)
+		: first(first), last(last)
 	{
-		ConditionalFunction::ValidateCompilation(scriptModule);
-		auto& top = scriptModule.nestStack.top();
-		auto topLine = top.line;
-		top.onEnd = [topLine](ScriptModule& mod)
-		{
-			if (!mod.ifResultStack.empty() && mod.ifResultStack.top())
-				mod.GoToLine(topLine);
-		};
 	}
-};
 
-class EndFunction : public Function
-{
-public:
+	std::shared_ptr<Token>* begin() const
+	{
+		return first;
+	}
 
-	EndFunction() : Function("end", 0) {}
+	std::shared_ptr<Token>* end() const
+	{
+		return last;
+	}
 
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule)
+	bool empty() const
 	{
-		const auto curLine = scriptModule.GetCurrentRunLine();
-		auto& e = scriptModule.endToBeginMap[curLine];
-		if (e.execute)
-		{
-			e.execute(scriptModule);
-		}
-		scriptModule.ifResultStack.pop();
-		return 0;
+		return first == last;
 	}
 
-	void ValidateCompilation(ScriptModule& scriptModule) override
+	std::size_t size() const
 	{
-		if (scriptModule.nestStack.empty())
-		{
-			throw ParseError("'end' statement is missing a begin-type statement (if / while / def)");
-		}
-		const auto& top = scriptModule.nestStack.top();
-		const auto curLine = scriptModule.GetCurrentCompileLine();
-
-		scriptModule.beginToEndMap[top.line] = curLine;
-		scriptModule.endToBeginMap[curLine] = EndToBegin(top.line, top.onEnd);
-		scriptModule.nestStack.pop();
+		return static_cast<std::size_t>(last - first);
 	}
+
+private:
+	std::shared_ptr<Token>* first = nullptr;
+	std::shared_ptr<Token>* last = nullptr;
 };
 
-class TrueFunction : public Function
+class ScriptLine
 {
 public:
+	// the compiled tokens, which the optimizer edits; ScriptModule::Finalize moves them into the module's code
+	std::vector<std::shared_ptr<Token>> tokens;
+	// the line's part of the module's code once finalized
+	TokenRange code;
+	// the 'end' of a 'for' loop, which RunLines runs by stepping the loop directly instead of evaluating the line
+	bool stepsForLoop = false;
 
-	TrueFunction() : Function("true", 0) {}
-
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	explicit ScriptLine(std::vector<std::shared_ptr<Token>> tokens)
+		: tokens(std::move(tokens))
 	{
-		return 1;
 	}
-};
-
-class FalseFunction : public Function
-{
-public:
-
-	FalseFunction() : Function("false", 0) {}
 
-	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	TokenRange Code()
 	{
-		return 0;
+		return code.empty() ? TokenRange(tokens) : code;
 	}
 };
 
-std::vector<Function*> s_functions =
+class SourceLocation
 {
-	new SqrtFunction(),
-	new PrintFunction(),
-	new IfFunction(),
-	new ElseFunction(),
-	new ElseIfFunction(),
-	new EndFunction(),
-	new WhileFunction(),
-	new TrueFunction(),
-	new FalseFunction(),
+public:
+	// 1-based; 0 when unknown
+	std::uint32_t line = 0;
+	std::uint32_t column = 0;
 };
 
-class StringIterator
+// Source location of every run line, compact enough to keep after the source text is gone. Each entry is stored
+// as the difference to the previous one in zigzag varints, usually a byte per field; every CHECKPOINT_INTERVAL
+// entries the absolute location and byte offset are kept, so a lookup decodes at most that many entries.
+class LineTable
 {
 public:
-	std::string string;
-	unsigned int pos = 0;
+	static constexpr std::size_t CHECKPOINT_INTERVAL = 32;
 
-	char Peek()
+	void Append(SourceLocation location)
 	{
-		return string.at(pos);
+		if (numEntries % CHECKPOINT_INTERVAL == 0)
+			checkpoints.push_back({bytes.size(), last});
+		WriteDelta(location.line, last.line);
+		WriteDelta(location.column, last.column);
+		last = location;
+		++numEntries;
 	}
 
-	char Seek()
+	SourceLocation Find(std::size_t index) const
 	{
-		return string.at(pos++);
+		if (index >= numEntries)
+			return {};
+		const auto& checkpoint = checkpoints[index / CHECKPOINT_INTERVAL];
+		auto location = checkpoint.location;
+		auto pos = checkpoint.offset;
+		for (auto i = index - index % CHECKPOINT_INTERVAL; i <= index; ++i)
+		{
+			location.line = ReadDelta(pos, location.line);
+			location.column = ReadDelta(pos, location.column);
+		}
+		return location;
 	}
 
-	bool End() const
+	std::size_t Size() const
 	{
-		return pos == string.size();
+		return numEntries;
 	}
 
-	explicit StringIterator(std::string string)
-		: string(std::move(string))
+	std::size_t MemoryUsage() const
 	{
+		return bytes.capacity() + checkpoints.capacity() * sizeof(Checkpoint);
 	}
 
-	void Advance()
+	// Editing re-encodes the table; only the optimizer does that
+	void Insert(std::size_t index, SourceLocation location)
 	{
-		++pos;
+		auto locations = Decode();
+		locations.insert(locations.begin() + static_cast<std::ptrdiff_t>(index), location);
+		Assign(locations);
 	}
 
-	std::string GetStringInQuotationMarks()
+	void Remove(const std::vector<bool>& removed)
 	{
-		Advance();
-		auto fPos = string.find_first_of('"', this->pos);
-		if (fPos == std::string::npos)
-			throw ParseError("Mismatched quotation marks (\")");
-		auto ret = string.substr(pos, fPos - pos);
-		pos = fPos + 1;
-		return ret;
+		auto locations = Decode();
+		std::size_t kept = 0;
+		for (auto i = 0u; i < locations.size(); ++i)
+		{
+			if (!removed[i])
+				locations[kept++] = locations[i];
+		}
+		locations.resize(kept);
+		Assign(locations);
 	}
 
-	std::string GetCurOperandString()
+private:
+	class Checkpoint
 	{
-		std::string result;
-		while (!End())
-		{
-			const auto ch = Peek();
-			if (isspace(static_cast<unsigned char>(ch)) || ispunct(static_cast<unsigned char>(ch)) && ch != '_')
-				break;
-			Advance();
-			result += ch;
-		}
-		return result;
+	public:
+		std::size_t offset;
+		// the location before the checkpoint's first entry, which is encoded relative to it
+		SourceLocation location;
+	};
+
+	std::vector<std::uint8_t> bytes;
+	std::vector<Checkpoint> checkpoints;
+	SourceLocation last;
+	std::size_t numEntries = 0;
+
+	void WriteDelta(std::uint32_t value, std::uint32_t previous)
+	{
+		const auto delta = static_cast<std::int64_t>(value) - previous;
+		auto zigzag = static_cast<std::uint64_t>(delta < 0 ? ~(delta * 2) : delta * 2);
+		for (; zigzag >= 0x80; zigzag >>= 7)
+			bytes.push_back(static_cast<std::uint8_t>(zigzag | 0x80));
+		bytes.push_back(static_cast<std::uint8_t>(zigzag));
 	}
 
-	std::string GetCurOperatorString()
+	std::uint32_t ReadDelta(std::size_t& pos, std::uint32_t previous) const
 	{
-		std::string result;
-		while (!End())
+		std::uint64_t zigzag = 0;
+		for (auto shift = 0;; shift += 7)
 		{
-			const auto ch = Peek();
-			if (isalnum(ch) || isspace(ch) || ch == '"')
+			const auto byte = bytes[pos++];
+			zigzag |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
 				break;
-			Advance();
-			result += ch;
-			if (ch == '(' || ch == ')')
-				return result;
 		}
-		return result;
+		const auto delta = static_cast<std::int64_t>(zigzag >> 1) ^ -static_cast<std::int64_t>(zigzag & 1);
+		return static_cast<std::uint32_t>(previous + delta);
 	}
 
-	Operator* FindOperator(const std::string& opStr)
+	std::vector<SourceLocation> Decode() const
 	{
-		for (auto& op : s_operators)
+		std::vector<SourceLocation> locations;
+		locations.reserve(numEntries);
+		SourceLocation location;
+		std::size_t pos = 0;
+		for (auto i = 0u; i < numEntries; ++i)
 		{
-			if (op->operator_ == opStr)
-			{
-				return op;
-			}
+			location.line = ReadDelta(pos, location.line);
+			location.column = ReadDelta(pos, location.column);
+			locations.push_back(location);
 		}
-		return nullptr;
+		return locations;
 	}
 
-	std::shared_ptr<OperatorToken> ParseOperator()
+	void Assign(const std::vector<SourceLocation>& locations)
 	{
-		auto opStr = GetCurOperatorString();
-		if (opStr.empty())
-		{
-			return nullptr;
-		}
-		if (opStr.size() > 2)
-			throw ParseError("Failed to parse operator " + opStr);
-		auto* op = FindOperator(opStr);
-		if (op)
-			return std::make_shared<OperatorToken>(op);
-		throw ParseError("Unsupported operator " + opStr);
+		*this = LineTable();
+		for (const auto& location : locations)
+			Append(location);
 	}
-	
 };
 
-std::shared_ptr<OperandToken> ParseNumericConstant(const std::string& opStr)
+class ScriptModule;
+class Function;
+
+class NestedBeginDeclaration
 {
-	try
-	{
-		const auto num = std::stod(opStr);
-		return Numeric(num);
-	}
-	catch (std::invalid_argument&)
+public:
+	std::string name;
+	std::size_t line;
+	std::function<void(ScriptModule&)> onEnd;
+	// the block pushes onto ifResultStack and its end pops it ('for' keeps its state elsewhere)
+	bool hasIfResult = true;
+	// 'break' / 'continue' lines of a loop, which learn their targets once the loop's 'end' is compiled
+	std::vector<std::size_t> loopExits;
+
+	NestedBeginDeclaration(const std::string& name, std::size_t line)
+		: name(name),
+		  line(line)
 	{
 	}
-	return nullptr;
-}
+};
 
-std::shared_ptr<FunctionCallToken> ParseFunctionCall(const std::string& opStr)
+class ScriptModule;
+
+class EndToBegin
 {
-	for (auto* iter : s_functions)
+public:
+	int lineNumber = 0;
+	std::function<void(ScriptModule&)> execute;
+	bool hasIfResult = true;
+	bool stepsForLoop = false;
+
+	EndToBegin(int lineNumber, std::function<void(ScriptModule&)> execute, bool hasIfResult = true)
+		: lineNumber(lineNumber),
+		  execute(std::move(execute)),
+		  hasIfResult(hasIfResult)
 	{
-		if (iter->name == opStr)
-		{
-			return std::make_shared<FunctionCallToken>(iter);
-		}
 	}
-	return nullptr;
-}
 
-std::shared_ptr<OperandToken> ParseVariableToken(const std::string& opStr)
-{
-	if (const auto iter = s_scriptModule.scriptVariables.find(opStr); iter != s_scriptModule.scriptVariables.end())
+	explicit EndToBegin(int lineNumber)
+		: lineNumber(lineNumber)
 	{
-		if (auto* numVar = dynamic_cast<NumericVariable*>(iter->second.get()))
-			return std::make_shared<NumericVariableToken>(numVar);
-		if (auto* strVar = dynamic_cast<StringVariable*>(iter->second.get()))
-			return std::make_shared<StringVariableToken>(strVar);
 	}
-	return nullptr;
-}
 
-bool IsOpenBracket(OperatorOrFunctionCallToken* token)
+
+	EndToBegin() = default;
+};
+
+// Where a 'break' or 'continue' line jumps to and which state of the blocks it leaves it unwinds
+class LoopExit
 {
-	if (auto* op = dynamic_cast<Operator*>(token->value))
-		return op->operator_ == "(";
-	return false;
-}
+public:
+	int endLine = 0;
+	// if blocks between the statement and its loop
+	int ifDepth = 0;
+	bool popsIfResult = false;
+	bool popsForLoop = false;
+	bool popsGeneratorLoop = false;
+};
 
-bool IsClosedBracket(OperatorOrFunctionCallToken* token)
+// Thrown by an async function call that has to wait; unwinds the line being evaluated so the script can be
+// resumed on that line once the call completes
+class ScriptSuspended
 {
-	if (auto* op = dynamic_cast<Operator*>(token->value))
-		return op->operator_ == ")";
-	return false;
-}
+};
 
-std::vector<std::shared_ptr<Token>> ParseExpression(StringIterator& iterator, ScriptModule& scriptModule)
+// One pending call of an async function. The host completes it from any thread; whoever waits for it is
+// notified once, even when the call completes before anyone starts waiting.
+class AsyncCall
 {
-	std::vector<std::shared_ptr<Token>> result;
-	std::stack<std::shared_ptr<OperatorOrFunctionCallToken>> operatorsOrFuncs;
-	while (!iterator.End())
+public:
+	void Complete(std::shared_ptr<OperandToken> value)
+	{
+		Finish(std::move(value), {});
+	}
+
+	void Fail(const std::string& message)
+	{
+		Finish(nullptr, message);
+	}
+
+	// Calls onDone on the completing thread, or right away if the call has completed already
+	void OnDone(std::function<void()> onDone)
 	{
-		if (isspace(iterator.Peek()))
-		{
-			iterator.Advance();
-			continue;
-		}
-		if (auto operator_ = iterator.ParseOperator())
 		{
-			if (IsClosedBracket(operator_.get()))
-			{
-				while (!operatorsOrFuncs.empty() && !IsOpenBracket(operatorsOrFuncs.top().get()))
-				{
-					result.push_back(std::move(operatorsOrFuncs.top()));
-					operatorsOrFuncs.pop();
-				}
-				if (operatorsOrFuncs.empty())
-					throw ParseError("Mismatched brackets");
-				operatorsOrFuncs.pop();
-			}
-			else
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!done)
 			{
-				if (!IsOpenBracket(operator_.get()))
-				{
-					while (!operatorsOrFuncs.empty() && operatorsOrFuncs.top()->value->Precedes(operator_->value) && !IsOpenBracket(operatorsOrFuncs.top().get()))
-					{
-						result.push_back(std::move(operatorsOrFuncs.top()));
-						operatorsOrFuncs.pop();
-					}
-				}
-				operatorsOrFuncs.push(std::move(operator_));
+				waiter = std::move(onDone);
+				return;
 			}
 		}
-		else
+		onDone();
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		completed.wait(lock, [this] { return done; });
+	}
+
+	// The call's value; a failed call raises its error in the script
+	std::shared_ptr<OperandToken> TakeResult()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!result)
+			throw ParseError(error);
+		return std::move(result);
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable completed;
+	bool done = false;
+	std::shared_ptr<OperandToken> result;
+	std::string error;
+	std::function<void()> waiter;
+
+	void Finish(std::shared_ptr<OperandToken> value, const std::string& message)
+	{
+		std::function<void()> onDone;
 		{
-			if (iterator.Peek() == '"')
-			{
-				auto str = iterator.GetStringInQuotationMarks();
-				result.push_back(std::make_shared<StringConstantToken>(str));
-			}
-			else
-			{
-				const auto opStr = iterator.GetCurOperandString();
-				if (!opStr.empty())
-				{
-					if (auto operand = ParseNumericConstant(opStr))
-					{
-						result.push_back(std::move(operand));
-					}
-					else if (auto function = ParseFunctionCall(opStr))
-					{
-						function->Value()->ValidateCompilation(scriptModule);
-						operatorsOrFuncs.push(std::move(function));
-					}
-					else
-					{
-						result.push_back(std::make_shared<StringConstantToken>(opStr));
-					}
-				}
-			}
+			std::lock_guard<std::mutex> lock(mutex);
+			if (done)
+				return;
+			done = true;
+			result = std::move(value);
+			error = message.empty() && !result ? "Async call completed without a value" : message;
+			onDone = std::move(waiter);
+			completed.notify_all();
 		}
+		if (onDone)
+			onDone();
 	}
-	while (!operatorsOrFuncs.empty())
+};
+
+// A 'for <name> in <generator> [<argument> ...]' loop over the values a generator yields
+class GeneratorLoopState
+{
+public:
+	// the generator's body runs in a frame of its own that keeps its position between values
+	std::unique_ptr<ScriptModule> frame;
+	std::string variableName;
+	std::size_t bodyLine = 0;
+	std::size_t generatorEndLine = 0;
+};
+
+// A running 'for' loop. The counter is the loop variable itself, stepped in place by the loop's 'end'.
+class ForLoopState
+{
+public:
+	std::shared_ptr<NumericVariable> counter;
+	double last = 0;
+	double step = 1;
+	std::size_t bodyLine = 0;
+
+	static bool InRange(double value, double last, double step)
 	{
-		result.push_back(std::move(operatorsOrFuncs.top()));
-		operatorsOrFuncs.pop();
+		return step > 0 ? value <= last : value >= last;
 	}
-	return result;
-}
 
-std::shared_ptr<OperandToken> EvaluateExpression(std::vector<std::shared_ptr<Token>>& tokens, ScriptModule& scriptModule)
+	// Steps the counter; the line to continue with, or 0 once the loop is done
+	std::size_t Step()
+	{
+		auto& value = counter->data;
+		value += step;
+		return InRange(value, last, step) ? bodyLine : 0;
+	}
+};
+
+// Work done by a run, for --report. Every module counts its own; frames are added to the module they were
+// created from once they have run, so that parallel loop bodies don't share counters.
+class RunStatistics
 {
-	std::stack<std::shared_ptr<OperandToken>> stack;
-	for (auto& token : tokens)
+public:
+	// tokens of the lines executed, each an operand, operator or function call
+	std::uint64_t instructions = 0;
+	std::uint64_t loopIterations = 0;
+
+	RunStatistics& operator+=(const RunStatistics& other)
 	{
-		if (auto operand = std::dynamic_pointer_cast<OperandToken>(token))
+		instructions += other.instructions;
+		loopIterations += other.loopIterations;
+		return *this;
+	}
+};
+
+// What compiling a script produces: its lines and how their blocks link up. Frames and instances of cached modules
+// share it with the module they were created from, so it only changes while the module is compiled and optimized.
+class CompiledScript
+{
+public:
+	std::vector<ScriptLine> scriptRunLines;
+	// the tokens of all lines in one array, filled by ScriptModule::Finalize
+	std::vector<std::shared_ptr<Token>> code;
+	// where each run line came from in the source
+	LineTable lineTable;
+	std::map<int, int> beginToEndMap;
+	std::map<int, EndToBegin> endToBeginMap;
+	std::map<int, LoopExit> loopExitMap;
+};
+
+class ScriptModule
+{
+public:
+
+	explicit ScriptModule(std::vector<std::string> scriptCompileLines)
+		: scriptCompileLines(std::move(scriptCompileLines))
+	{
+	}
+
+	ScriptModule() = default;
+	
+	std::vector<std::string> scriptCompileLines;
+	// shared with the frames and instances created from this module
+	std::shared_ptr<CompiledScript> compiled = std::make_shared<CompiledScript>();
+	// run line the line being compiled will get; only meaningful while isCompiling is set
+	std::size_t curCompileLine = 0;
+	bool isCompiling = false;
+	std::size_t curRunLine = 0;
+	std::size_t nextRunLine = 0;
+	std::map<std::string, std::shared_ptr<Variable>, std::less<>> scriptVariables;
+	std::stack<NestedBeginDeclaration> nestStack;
+	std::stack<bool, std::vector<bool>> ifResultStack;
+	std::vector<ForLoopState> forLoopStack;
+	std::vector<GeneratorLoopState> generatorLoopStack;
+	// set by 'yield' in a generator's frame: the value and the line to continue with
+	std::shared_ptr<OperandToken> yieldedValue;
+	std::size_t resumeLine = 0;
+	// compile time: the loop header function of every generator defined so far, and ownership of such
+	// per-script functions
+	std::map<std::string, Function*, std::less<>> generatorLoops;
+	std::vector<std::unique_ptr<Function>> scriptFunctions;
+	std::uint64_t sourceHash = FNV_OFFSET_BASIS;
+	// the async call the script is suspended on, and the completed one its line picks up when resumed
+	std::shared_ptr<AsyncCall> pendingCall;
+	std::shared_ptr<AsyncCall> completedCall;
+	// set for the private frames parallel loop bodies run in; variables not found here are looked up there
+	ScriptModule* outerScope = nullptr;
+	// for instances of a cached module: the module whose code and functions the instance runs
+	std::shared_ptr<const ScriptModule> codeOwner;
+	// what the script's values and code take up; frames use the one of the module they were created from
+	std::unique_ptr<MemoryAccount, MemoryAccount::Closer> memory{new MemoryAccount};
+	bool isCodeCharged = false;
+	RunStatistics statistics;
+
+	bool Compile();
+	void CompileLine(const std::string& line);
+	void Optimize();
+	void Finalize();
+	void LinkLine(std::size_t line);
+	void RemoveRunLines(const std::vector<bool>& removed);
+	void RelinkBlocks();
+	void Execute(std::size_t fromLine = 0);
+	void Resume();
+	void RunToCompletion(std::size_t fromLine = 0);
+	void RunLines(std::size_t fromLine, std::size_t toLine);
+	std::unique_ptr<ScriptModule> CreateFrame();
+	std::unique_ptr<ScriptModule> CopyCode() const;
+	std::size_t MemoryUsage() const;
+	void SaveSnapshot(std::ostream& os);
+	void LoadSnapshot(std::istream& is);
+	std::size_t GetCurrentCompileLine()
+	{
+		return curCompileLine;
+	}
+	std::size_t GetCurrentRunLine()
+	{
+		return curRunLine;
+	}
+
+	// The given line is the next one to execute
+	void GoToLine(std::size_t line)
+	{
+		nextRunLine = line;
+	}
+
+	// Runs the 'end' of the innermost 'for' loop
+	void StepForLoop()
+	{
+		if (const auto bodyLine = forLoopStack.back().Step())
+		{
+			GoToLine(bodyLine);
+			++statistics.loopIterations;
+		}
+		else
+			forLoopStack.pop_back();
+	}
+
+	// 1-based source line of a run line, for error messages
+	int SourceLine(std::size_t runLine) const
+	{
+		return static_cast<int>(compiled->lineTable.Find(runLine).line);
+	}
+
+	bool IsSuspended() const
+	{
+		return pendingCall != nullptr;
+	}
+
+	MemoryAccount& Memory()
+	{
+		return outerScope ? outerScope->Memory() : *memory;
+	}
+
+	Variable* FindVariable(std::string_view name)
+	{
+		for (auto* scope = this; scope; scope = scope->outerScope)
+		{
+			if (const auto iter = scope->scriptVariables.find(name); iter != scope->scriptVariables.end())
+				return iter->second.get();
+		}
+		return nullptr;
+	}
+};
+
+ScriptModule s_scriptModule;
+// the module whose variables the running thread reads and assigns; parallel loop bodies switch to their frame
+thread_local ScriptModule* t_activeModule = &s_scriptModule;
+
+// Makes the given module, and its memory account, the active one for the lifetime of the scope
+class ActiveModuleScope
+{
+public:
+	explicit ActiveModuleScope(ScriptModule& scriptModule)
+		: previous(t_activeModule), previousAccount(MemoryAccount::Active())
+	{
+		t_activeModule = &scriptModule;
+		MemoryAccount::SetActive(&scriptModule.Memory());
+	}
+
+	~ActiveModuleScope()
+	{
+		t_activeModule = previous;
+		MemoryAccount::SetActive(previousAccount);
+	}
+
+	ActiveModuleScope(const ActiveModuleScope&) = delete;
+	ActiveModuleScope& operator=(const ActiveModuleScope&) = delete;
+
+private:
+	ScriptModule* previous;
+	MemoryAccount* previousAccount;
+};
+
+enum class TraceKind : std::uint8_t
+{
+	Compile,
+	Line,
+	Call,
+	Branch,
+	Assign,
+};
+
+// One trace point as stored in the ring buffer. Compiles, lines and calls are spans, branches and assignments are
+// instants; value is the branch taken (1) or not (0), or the number of lines compiled.
+struct TraceEvent
+{
+	std::uint64_t start;
+	std::uint64_t duration;
+	char name[24];
+	std::uint32_t line;
+	std::uint32_t value;
+	std::uint16_t thread;
+	TraceKind kind;
+};
+
+// Records trace points into a fixed ring buffer that keeps the most recent CAPACITY events, from any thread.
+// Disabled, a trace point costs one load of a flag; enabling and disabling is safe while scripts run, dumping
+// the buffer is meant for when they don't.
+class Tracer
+{
+public:
+	static constexpr std::size_t CAPACITY = 1 << 16;
+
+	static bool IsEnabled()
+	{
+		return enabled.load(std::memory_order_acquire) && numSuspensions == 0;
+	}
+
+	static void Enable(bool enable)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (enable && !events)
+		{
+			events = std::make_unique<TraceEvent[]>(CAPACITY);
+			epoch = std::chrono::steady_clock::now();
+		}
+		enabled.store(enable, std::memory_order_release);
+	}
+
+	// Nanoseconds since tracing was first enabled
+	static std::uint64_t Now()
+	{
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+	}
+
+	static void Record(TraceKind kind, std::string_view name, std::uint32_t line, std::uint32_t value, std::uint64_t start, std::uint64_t duration)
+	{
+		auto& event = events[next.fetch_add(1, std::memory_order_relaxed) & (CAPACITY - 1)];
+		event.start = start;
+		event.duration = duration;
+		const auto length = std::min(name.size(), sizeof event.name - 1);
+		std::memcpy(event.name, name.data(), length);
+		event.name[length] = '\0';
+		event.line = line;
+		event.value = value;
+		event.thread = ThreadNumber();
+		event.kind = kind;
+	}
+
+	static void Instant(TraceKind kind, std::string_view name, std::uint32_t line, std::uint32_t value = 0)
+	{
+		Record(kind, name, line, value, Now(), 0);
+	}
+
+	// The buffered events in the Chrome trace event format, for chrome://tracing or Perfetto
+	static void WriteChromeTrace(std::ostream& os)
+	{
+		static const char* const categories[] = {"compile", "line", "call", "branch", "assign"};
+		const auto end = events ? next.load() : 0;
+		const auto first = end > CAPACITY ? end - CAPACITY : 0;
+		os << "{\"traceEvents\":[";
+		for (auto i = first; i < end; ++i)
+		{
+			const auto& event = events[i & (CAPACITY - 1)];
+			const auto isSpan = event.kind == TraceKind::Compile || event.kind == TraceKind::Line || event.kind == TraceKind::Call;
+			os << (i == first ? "\n" : ",\n") << "{\"name\":\"";
+			for (const auto* ch = event.name; *ch; ++ch)
+			{
+				if (*ch == '"' || *ch == '\\')
+					os << '\\';
+				os << *ch;
+			}
+			os << "\",\"cat\":\"" << categories[static_cast<int>(event.kind)] << "\",\"ph\":\"" << (isSpan ? "X" : "i")
+				<< "\",\"ts\":" << event.start / 1000 << '.' << std::setw(3) << std::setfill('0') << event.start % 1000;
+			if (isSpan)
+				os << ",\"dur\":" << event.duration / 1000 << '.' << std::setw(3) << std::setfill('0') << event.duration % 1000;
+			else
+				os << ",\"s\":\"t\"";
+			os << ",\"pid\":1,\"tid\":" << event.thread << ",\"args\":{\"line\":" << event.line;
+			if (event.kind == TraceKind::Branch)
+				os << ",\"taken\":" << event.value;
+			else if (event.kind == TraceKind::Compile)
+				os << ",\"lines\":" << event.value;
+			os << "}}";
+		}
+		os << "\n]}\n";
+	}
+
+private:
+	friend class TraceSuspension;
+
+	static inline std::atomic<bool> enabled{false};
+	static inline thread_local int numSuspensions = 0;
+	static inline std::atomic<std::size_t> next{0};
+	static inline std::unique_ptr<TraceEvent[]> events;
+	static inline std::chrono::steady_clock::time_point epoch;
+	static inline std::mutex mutex;
+
+	static std::uint16_t ThreadNumber()
+	{
+		static std::atomic<std::uint16_t> numThreads{0};
+		thread_local const auto number = ++numThreads;
+		return number;
+	}
+};
+
+#if KSCRIPT_TRACING
+#define TRACE_ENABLED() Tracer::IsEnabled()
+#else
+#define TRACE_ENABLED() false
+#endif
+
+// Turns trace points on this thread off for its lifetime, for code that runs script operations outside of a run
+class TraceSuspension
+{
+public:
+	TraceSuspension()
+	{
+		++Tracer::numSuspensions;
+	}
+
+	~TraceSuspension()
+	{
+		--Tracer::numSuspensions;
+	}
+
+	TraceSuspension(const TraceSuspension&) = delete;
+	TraceSuspension& operator=(const TraceSuspension&) = delete;
+};
+
+// Records a span from Begin to the end of the scope; trace points call Begin only if TRACE_ENABLED()
+class TraceScope
+{
+public:
+	TraceScope() = default;
+
+	~TraceScope()
+	{
+		if (isActive)
+			Tracer::Record(kind, std::string_view(name, length), line, value, start, Tracer::Now() - start);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	void Begin(TraceKind traceKind, std::string_view traceName, std::uint32_t traceLine, std::uint32_t traceValue = 0)
+	{
+		kind = traceKind;
+		length = std::min(traceName.size(), sizeof name);
+		std::memcpy(name, traceName.data(), length);
+		line = traceLine;
+		value = traceValue;
+		start = Tracer::Now();
+		isActive = true;
+	}
+
+private:
+	bool isActive = false;
+	std::uint64_t start = 0;
+	std::size_t length = 0;
+	std::uint32_t line = 0;
+	std::uint32_t value = 0;
+	TraceKind kind = TraceKind::Line;
+	char name[sizeof TraceEvent::name];
+};
+
+// Source line of the active module's current line, for trace points
+std::uint32_t TraceLine()
+{
+	return static_cast<std::uint32_t>(t_activeModule->SourceLine(t_activeModule->curRunLine));
+}
+
+// The variable an operand names: a bare name, or a variable it already resolved to. Empty for other operands.
+std::string_view GetVariableName(OperandToken* token)
+{
+	if (auto* varNameToken = dynamic_cast<StringConstantToken*>(token))
+		return varNameToken->value.View();
+	if (auto* varToken = dynamic_cast<VariableToken*>(token))
+		return varToken->GetVariable()->name;
+	return {};
+}
+
+// Operand stack and parameter vectors kept per thread so evaluating a line doesn't allocate once they have grown.
+// A nested evaluation only uses the part of the stack above where it started and the parameter vector of its depth.
+class EvaluationFrame
+{
+public:
+	EvaluationFrame()
+		: storage(GetStorage()), base(storage.values.size()), depth(storage.depth++)
+	{
+		if (storage.params.size() <= depth)
+			storage.params.emplace_back();
+	}
+
+	~EvaluationFrame()
+	{
+		storage.values.erase(storage.values.begin() + base, storage.values.end());
+		storage.params[depth].clear();
+		if (--storage.depth == 0)
+			storage.retired.clear();
+	}
+
+	EvaluationFrame(const EvaluationFrame&) = delete;
+	EvaluationFrame& operator=(const EvaluationFrame&) = delete;
+
+	std::size_t Size() const
+	{
+		return storage.values.size() - base;
+	}
+
+	void Push(std::shared_ptr<OperandToken> value)
+	{
+		storage.values.push_back(std::move(value));
+	}
+
+	std::shared_ptr<OperandToken> Pop()
+	{
+		auto value = std::move(storage.values.back());
+		storage.values.pop_back();
+		return value;
+	}
+
+	// Moves the top numParams values into the parameter vector, first argument first
+	std::vector<std::shared_ptr<OperandToken>>& PopParams(std::size_t numParams)
+	{
+		auto& params = storage.params[depth];
+		params.clear();
+		const auto first = storage.values.end() - static_cast<std::ptrdiff_t>(numParams);
+		std::move(first, storage.values.end(), std::back_inserter(params));
+		storage.values.erase(first, storage.values.end());
+		return params;
+	}
+
+	void ReleaseParams()
+	{
+		storage.params[depth].clear();
+	}
+
+	// Operands of the evaluations running on this thread that read the variable get its current value instead, so
+	// that assigning the variable in place doesn't change what was pushed before, as in 'n + (n = 5)'
+	static void Freeze(Variable* variable)
+	{
+		auto& storage = GetStorage();
+		auto freeze = [variable](std::shared_ptr<OperandToken>& operand)
+		{
+			auto* variableToken = dynamic_cast<VariableToken*>(operand.get());
+			if (!variableToken || variableToken->GetVariable() != variable)
+				return;
+			if (auto* numVar = dynamic_cast<NumericVariable*>(variable))
+				operand = Numeric(numVar->data);
+			else if (auto* strVar = dynamic_cast<StringVariable*>(variable))
+				operand = MakeString(strVar->data);
+		};
+		for (auto& operand : storage.values)
+			freeze(operand);
+		for (auto d = 0u; d < storage.depth; ++d)
+		{
+			for (auto& operand : storage.params[d])
+				freeze(operand);
+		}
+	}
+
+	// Keeps a variable that was replaced while evaluating until the line finishes, as its token may still be
+	// borrowed (see Borrow)
+	static void Retire(std::shared_ptr<Variable> variable)
+	{
+		auto& storage = GetStorage();
+		if (variable && storage.depth)
+			storage.retired.push_back(std::move(variable));
+	}
+
+private:
+	struct Storage
+	{
+		std::vector<std::shared_ptr<OperandToken>> values;
+		// a deque so that growing it never moves the vectors of enclosing frames
+		std::deque<std::vector<std::shared_ptr<OperandToken>>> params;
+		std::vector<std::shared_ptr<Variable>> retired;
+		std::size_t depth = 0;
+	};
+
+	static Storage& GetStorage()
+	{
+		thread_local Storage storage;
+		return storage;
+	}
+
+	Storage& storage;
+	std::size_t base;
+	std::size_t depth;
+};
+
+void ReplaceVariable(ScriptModule& scriptModule, std::shared_ptr<Variable> variable)
+{
+	auto& slot = scriptModule.scriptVariables[variable->name];
+	// a running loop steps its counter in place, so the counter has to stay a number
+	for (const auto& loop : scriptModule.forLoopStack)
+	{
+		if (loop.counter == slot)
+			throw ParseError("Can't assign anything but a number to '" + variable->name + "' while its 'for' loop runs");
+	}
+	EvaluationFrame::Retire(std::move(slot));
+	slot = std::move(variable);
+}
+
+class AssignVariableOperation : public DualOperandOperation
+{
+public:
+	std::shared_ptr<OperandToken> Eval(OperandToken* a, OperandToken* b) override
+	{
+		const auto varName = GetVariableName(a);
+		if (varName.empty())
+			return nullptr;
+		if (TRACE_ENABLED())
+			Tracer::Instant(TraceKind::Assign, varName, TraceLine());
+
+		// a variable that keeps its type is updated in place, reusing its token and string capacity
+		auto& variables = t_activeModule->scriptVariables;
+		const auto iter = variables.find(varName);
+		auto* existing = iter != variables.end() ? iter->second.get() : nullptr;
+		if (auto* numericToken = dynamic_cast<NumericToken*>(b))
+		{
+			const auto value = numericToken->Value();
+			if (auto* numVar = dynamic_cast<NumericVariable*>(existing))
+			{
+				EvaluationFrame::Freeze(numVar);
+				numVar->data = value;
+				return Borrow(GetVariableToken(numVar).get());
+			}
+			return SetVariable(MakePooled<NumericVariable>(std::string(varName), value));
+		}
+		if (auto* stringToken = dynamic_cast<StringToken*>(b))
+		{
+			const auto& value = stringToken->Value();
+			if (auto* strVar = dynamic_cast<StringVariable*>(existing))
+			{
+				EvaluationFrame::Freeze(strVar);
+				strVar->data = value;
+				return Borrow(GetVariableToken(strVar).get());
+			}
+			return SetVariable(MakePooled<StringVariable>(std::string(varName), value));
+		}
+		if (auto* arrayToken = dynamic_cast<ArrayVariableToken*>(b))
+		{
+			auto array = MakePooled<ArrayVariable>(std::string(varName));
+			array->numbers = arrayToken->variable->numbers;
+			array->strings = arrayToken->variable->strings;
+			array->isNumeric = arrayToken->variable->isNumeric;
+			array->ChargeElements();
+			return SetVariable(std::move(array));
+		}
+		return nullptr;
+	}
+
+private:
+	static std::shared_ptr<OperandToken> SetVariable(std::shared_ptr<Variable> variable)
+	{
+		auto* token = GetVariableToken(variable.get()).get();
+		ReplaceVariable(*t_activeModule, std::move(variable));
+		return Borrow(token);
+	}
+};
+
+// 'name = value' in the active module
+void AssignVariable(std::string_view name, OperandToken* value)
+{
+	StringConstantToken nameToken{StringValue(name)};
+	if (!AssignVariableOperation().Eval(&nameToken, value))
+		throw ParseError("Can't assign that value to '" + std::string(name) + "'");
+}
+
+class LogicalOrOperation : public DualNumericsOperationOf<LogicalOrOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a || b;
+	}
+};
+
+class LogicalAndOperation : public DualNumericsOperationOf<LogicalAndOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a && b;
+	}
+};
+
+bool DoubleEquals(double a, double b)
+{
+	const auto EPSILON = 0.0001;
+	const auto diff = a - b;
+	return diff < EPSILON && -diff < EPSILON;
+}
+
+class EqualsOperation : public DualNumericsOperationOf<EqualsOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return DoubleEquals(a, b);
+	}
+};
+
+class NotEqualsOperation : public DualNumericsOperationOf<NotEqualsOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return !DoubleEquals(a, b);
+	}
+};
+
+class GTOperation : public DualNumericsOperationOf<GTOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a > b;
+	}
+};
+
+class GTEOperation : public DualNumericsOperationOf<GTEOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a >= b;
+	}
+};
+
+
+class LTOperation : public DualNumericsOperationOf<LTOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a < b;
+	}
+};
+
+class LTEOperation : public DualNumericsOperationOf<LTEOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a <= b;
+	}
+};
+
+class BitwiseAndOperation : public DualNumericsOperationOf<BitwiseAndOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return static_cast<int>(a) & static_cast<int>(b);
+	}
+};
+
+class BitwiseOrOperation : public DualNumericsOperationOf<BitwiseOrOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return static_cast<int>(a) | static_cast<int>(b);
+	}
+};
+
+class LeftShiftOperation : public DualNumericsOperationOf<LeftShiftOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return static_cast<int64_t>(a) << static_cast<int>(b);
+	}
+};
+
+class RightShiftOperation : public DualNumericsOperationOf<RightShiftOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return static_cast<int>(a) >> static_cast<int>(b);
+	}
+};
+
+class MultiplyOperation : public DualNumericsOperationOf<MultiplyOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a * b;
+	}
+};
+
+class AddOperation : public DualNumericsOperationOf<AddOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a + b;
+	}
+};
+
+class SubtractOperation : public DualNumericsOperationOf<SubtractOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return a - b;
+	}
+};
+
+class DivideOperation : public DualNumericsOperationOf<DivideOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		if (b == 0)
+		{
+			throw ParseError("Division by zero");
+		}
+		return a / b;
+	}
+
+	// checks the divisors first, so the division loop has no branch
+	void ApplyColumns(const double* a, const double* b, double* result, std::size_t count) const override
+	{
+		if (std::find(b, b + count, 0.0) != b + count)
+			throw ParseError("Division by zero");
+		for (std::size_t i = 0; i < count; ++i)
+			result[i] = a[i] / b[i];
+	}
+};
+
+class ModuloOperation : public DualNumericsOperationOf<ModuloOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		if (b == 0)
+		{
+			throw ParseError("Modulo by zero");
+		}
+		return static_cast<int>(a) % static_cast<int>(b);
+	}
+};
+
+class PowOperation : public DualNumericsOperationOf<PowOperation>
+{
+public:
+	static double Compute(double a, double b)
+	{
+		return std::pow(a, b);
+	}
+};
+
+class NegateOperation : public SingleNumericOperationOf<NegateOperation>
+{
+public:
+	static double Compute(double t)
+	{
+		return -t;
+	}
+};
+
+class LogicalNotOperation : public SingleNumericOperationOf<LogicalNotOperation>
+{
+public:
+	static double Compute(double t)
+	{
+		return !t;
+	}
+};
+
+std::vector<Operator*> s_operators =
+{
+	new DualOperandOperator("=", 2, {new AssignVariableOperation()}),
+	new DualOperandOperator("||", 5, {new LogicalOrOperation()}),
+	new DualOperandOperator("&&", 7, {new LogicalAndOperation()}),
+	new DualOperandOperator("==", 13, {new EqualsOperation()}),
+	new DualOperandOperator("!=", 15, {new NotEqualsOperation()}),
+	new DualOperandOperator(">", 15, {new GTOperation()}),
+	new DualOperandOperator("<", 15, {new LTOperation()}),
+	new DualOperandOperator(">=", 15, {new GTEOperation()}),
+	new DualOperandOperator("<=", 15, {new LTEOperation()}),
+	new DualOperandOperator("|", 16, {new BitwiseOrOperation()}),
+	new DualOperandOperator("&", 16, {new BitwiseAndOperation()}),
+	new DualOperandOperator("<<", 18, {new LeftShiftOperation()}),
+	new DualOperandOperator(">>", 18, {new RightShiftOperation()}),
+	new DualOperandOperator("+", 19, {new AddOperation(), new StringAddOperation()}),
+	new DualOperandOperator("-", 19, {new SubtractOperation()}),
+	new DualOperandOperator("*", 21, {new MultiplyOperation()}),
+	new DualOperandOperator("/", 21, {new DivideOperation()}),
+	new DualOperandOperator("%", 21, {new ModuloOperation()}),
+	new DualOperandOperator("^", 23, {new PowOperation()}),
+	new SingleOperandOperator("-", 25, {new NegateOperation()}),
+	new SingleOperandOperator("!", 27, {new LogicalNotOperation()}),
+	new Operator("(", 80, 0),
+	new Operator(")", 80, 0),
+};
+
+
+
+class Function : public OperatorOrFunction
+{
+public:
+	std::string name;
+	std::size_t numParams;
+
+	explicit Function(std::string name, std::size_t numParams)
+		: OperatorOrFunction(23), name(std::move(name)), numParams(numParams)
+	{
+	}
+
+	virtual double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) = 0;
+
+	virtual std::shared_ptr<OperandToken> Call(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule)
+	{
+		return Numeric(Execute(params, scriptModule));
+	}
+
+	virtual bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) { return true; };
+	
+	virtual void ValidateCompilation(ScriptModule& scriptModule)
+	{
+	}
+
+	// The result only depends on the parameters and calling it has no side effects, so calls with constant
+	// parameters can be evaluated at compile time
+	virtual bool IsPure() const
+	{
+		return false;
+	}
+
+	// Reads or defines variables without naming them in the script, which rules out optimizing by variable name
+	virtual bool HasHiddenVariableAccess() const
+	{
+		return false;
+	}
+
+	// The first parameter names a variable the call assigns, like the loop variable of 'for'
+	virtual bool DefinesVariable() const
+	{
+		return false;
+	}
+
+	// Can be called from the threads of a parallel loop; false for functions working on the shared input,
+	// output file or whole script state
+	virtual bool IsThreadSafe() const
+	{
+		return true;
+	}
+
+	// Takes and returns numbers only, so compiled expressions can call ExecuteNumeric with plain values
+	virtual bool HasNumericForm() const
+	{
+		return false;
+	}
+
+	virtual double ExecuteNumeric(const double* args) const
+	{
+		return 0;
+	}
+
+	// count results at once, from a column of count values per parameter
+	virtual void ExecuteNumericColumns(const double* const* args, double* result, std::size_t count) const
+	{
+		std::vector<double> row(numParams);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			for (auto param = 0u; param < numParams; ++param)
+				row[param] = args[param][i];
+			result[i] = ExecuteNumeric(row.data());
+		}
+	}
+};
+
+class StringFunction : public Function
+{
+public:
+	StringFunction(std::string name, std::size_t numParams)
+		: Function(std::move(name), numParams)
+	{
+	}
+
+	virtual std::shared_ptr<StringToken> ExecuteString(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) = 0;
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return 0;
+	}
+
+	std::shared_ptr<OperandToken> Call(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return ExecuteString(params, scriptModule);
+	}
+};
+
+class NestedFunction : public Function
+{
+public:
+	NestedFunction(const std::string& name, std::size_t numParams)
+		: Function(name, numParams)
+	{
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		if (!scriptModule.isCompiling)
+			throw ParseError("'" + name + "' can only be used in a compiled script");
+		scriptModule.nestStack.emplace(name, scriptModule.GetCurrentCompileLine());
+	}
+};
+
+class FunctionCallToken : public OperatorOrFunctionCallToken
+{
+public:
+
+	explicit FunctionCallToken(Function* function) : OperatorOrFunctionCallToken(function)
+	{
+	}
+
+	Function* Value()
+	{
+		return dynamic_cast<Function*>(value);
+	}
+
+	std::string ToString() override
+	{
+		return Value()->name;
+	}
+};
+
+class SqrtFunction : public Function
+{
+public:
+
+	SqrtFunction() : Function("sqrt", 1){}
+
+	bool IsPure() const override
+	{
+		return true;
+	}
+
+	bool HasNumericForm() const override
+	{
+		return true;
+	}
+
+	double ExecuteNumeric(const double* args) const override
+	{
+		return std::sqrt(args[0]);
+	}
+
+	void ExecuteNumericColumns(const double* const* args, double* result, std::size_t count) const override
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			result[i] = std::sqrt(args[0][i]);
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		auto* param = dynamic_cast<NumericToken*>(params.at(0).get());
+		return std::sqrt(param->Value());
+	}
+
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<NumericToken*>(params.at(0).get());
+	}
+};
+
+// Single-producer ring buffer drained into a file by a dedicated thread, so the interpreter only blocks when the ring is full
+class AsyncOutputWriter
+{
+public:
+	static constexpr std::size_t CAPACITY = 1 << 22;
+	static constexpr std::size_t WAKE_THRESHOLD = 1 << 16;
+
+	AsyncOutputWriter(std::FILE* file, bool ownsFile)
+		: buffer(new char[CAPACITY]), file(file), ownsFile(ownsFile)
+	{
+		thread = std::thread([this] { Run(); });
+	}
+
+	~AsyncOutputWriter()
+	{
+		stopping.store(true);
+		Wake();
+		thread.join();
+		if (ownsFile)
+			std::fclose(file);
+	}
+
+	AsyncOutputWriter(const AsyncOutputWriter&) = delete;
+	AsyncOutputWriter& operator=(const AsyncOutputWriter&) = delete;
+
+	// Single producer: only one thread may write at a time, which ScriptOutput ensures
+	void Write(std::string_view data)
+	{
+		while (!data.empty())
+		{
+			const auto curHead = head.load(std::memory_order_relaxed);
+			const auto used = curHead - tail.load(std::memory_order_acquire);
+			if (used == CAPACITY)
+			{
+				WaitUntil([&] { return tail.load() != curHead - CAPACITY; });
+				continue;
+			}
+			const auto count = std::min(CAPACITY - used, data.size());
+			const auto offset = curHead & (CAPACITY - 1);
+			const auto first = std::min(count, CAPACITY - offset);
+			std::memcpy(buffer.get() + offset, data.data(), first);
+			std::memcpy(buffer.get(), data.data() + first, count - first);
+			head.store(curHead + count);
+			data.remove_prefix(count);
+		}
+		if (writerSleeping.load() && head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed) >= WAKE_THRESHOLD)
+			Wake();
+	}
+
+	// Blocks until everything written so far has reached the file
+	void Flush()
+	{
+		const auto target = head.load(std::memory_order_relaxed);
+		WaitUntil([&] { return flushed.load() >= target; });
+	}
+
+private:
+	std::unique_ptr<char[]> buffer;
+	std::FILE* file;
+	bool ownsFile;
+	std::atomic<std::size_t> head{0};
+	std::atomic<std::size_t> tail{0};
+	std::atomic<std::size_t> flushed{0};
+	std::atomic<bool> writerSleeping{false};
+	std::atomic<bool> producerWaiting{false};
+	std::atomic<bool> stopping{false};
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::condition_variable progressed;
+	std::thread thread;
+
+	void Wake()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		wakeUp.notify_one();
+	}
+
+	// Blocks the producer until the writer thread has moved tail or flushed far enough for done()
+	template <typename Done>
+	void WaitUntil(Done done)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		// set before done() is checked, so that the writer either sees it or has already made done() true
+		producerWaiting.store(true);
+		wakeUp.notify_one();
+		progressed.wait(lock, done);
+		producerWaiting.store(false);
+	}
+
+	void Progressed()
+	{
+		if (!producerWaiting.load())
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		progressed.notify_one();
+	}
+
+	void Run()
+	{
+		while (true)
+		{
+			const auto curTail = tail.load(std::memory_order_relaxed);
+			const auto curHead = head.load(std::memory_order_acquire);
+			if (curHead == curTail)
+			{
+				std::fflush(file);
+				flushed.store(curTail);
+				Progressed();
+				if (stopping.load() && head.load() == curTail)
+					return;
+				std::unique_lock<std::mutex> lock(mutex);
+				writerSleeping.store(true);
+				if (head.load() == curTail && !stopping.load())
+					wakeUp.wait_for(lock, std::chrono::milliseconds(2));
+				writerSleeping.store(false);
+				continue;
+			}
+			const auto offset = curTail & (CAPACITY - 1);
+			const auto count = std::min(curHead - curTail, CAPACITY - offset);
+			std::fwrite(buffer.get() + offset, 1, count, file);
+			tail.store(curTail + count);
+			Progressed();
+		}
+	}
+};
+
+// Destination of print/write; synchronous std::cout unless an async writer has been installed. Any number of
+// threads may write, e.g. modules run side by side by a host; each write reaches the output in one piece.
+// Installing a writer and flushing are left to the thread running the script.
+class ScriptOutput
+{
+public:
+	// Writes str, followed by a line break if asked for
+	void Write(std::string_view str, bool endLine = false)
+	{
+		if (auto* capture = Capture())
+		{
+			capture->append(str);
+			if (endLine)
+				capture->push_back('\n');
+			return;
+		}
+		bytesWritten.fetch_add(str.size() + endLine, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(producerMutex);
+		if (writer)
+		{
+			writer->Write(str);
+			if (endLine)
+				writer->Write("\n");
+		}
+		else
+		{
+			std::cout << str;
+			if (endLine)
+				std::cout << std::endl;
+		}
+	}
+
+	void EndLine()
+	{
+		Write({}, true);
+	}
+
+	// Bytes that reached the output so far; captured output counts once it is written on
+	std::size_t BytesWritten() const
+	{
+		return bytesWritten.load(std::memory_order_relaxed);
+	}
+
+	void Flush()
+	{
+		if (writer)
+			writer->Flush();
+		else
+			std::cout.flush();
+	}
+
+	void UseAsync(std::FILE* file, bool ownsFile)
+	{
+		Flush();
+		writer.reset();
+		writer = std::make_unique<AsyncOutputWriter>(file, ownsFile);
+	}
+
+	bool IsAsync() const
+	{
+		return writer != nullptr;
+	}
+
+	// Output written by the calling thread goes to the given buffer instead, until called with nullptr. Returns
+	// the buffer it replaces, which nested captures restore when they end.
+	static std::string* CaptureThread(std::string* buffer)
+	{
+		return std::exchange(Capture(), buffer);
+	}
+
+private:
+	static std::string*& Capture()
+	{
+		thread_local std::string* capture = nullptr;
+		return capture;
+	}
+
+
+	std::unique_ptr<AsyncOutputWriter> writer;
+	std::mutex producerMutex;
+	std::atomic<std::size_t> bytesWritten{0};
+};
+
+ScriptOutput s_output;
+
+class PrintFunction : public Function
+{
+public:
+
+	PrintFunction() : PrintFunction("print", true) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		if (auto* strToken = dynamic_cast<StringToken*>(params.at(0).get()))
+		{
+			s_output.Write(strToken->View(), newLine);
+		}
+		else if (auto* numericToken = dynamic_cast<NumericToken*>(params.at(0).get()))
+		{
+			s_output.Write(ToString(numericToken->Value()), newLine);
+		}
+		else if (newLine)
+			s_output.EndLine();
+		return 1;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return true;
+	}
+
+protected:
+	bool newLine;
+
+	PrintFunction(const std::string& name, bool newLine)
+		: Function(name, 1), newLine(newLine)
+	{
+	}
+};
+
+class WriteFunction : public PrintFunction
+{
+public:
+
+	WriteFunction() : PrintFunction("write", false) {}
+};
+
+class OutputFunction : public Function
+{
+public:
+
+	OutputFunction() : Function("output", 1) {}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	// Redirects print/write into the given file through the async writer
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto fileName = dynamic_cast<StringToken*>(params.at(0).get())->ToString();
+		auto* file = std::fopen(fileName.c_str(), "wb");
+		if (!file)
+			return 0;
+		s_output.UseAsync(file, true);
+		return 1;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get());
+	}
+};
+
+class ConditionalFunction : public NestedFunction
+{
+public:
+	ConditionalFunction(const std::string& name)
+		: NestedFunction(name, 1)
+	{
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		bool val = false;
+		if (auto* numToken = dynamic_cast<NumericToken*>(params.at(0).get()))
+		{
+			val = numToken->Value();
+			if (!val)
+			{
+				const auto line = scriptModule.compiled->beginToEndMap.at(scriptModule.GetCurrentRunLine());
+				scriptModule.GoToLine(line);
+			}
+		}
+		if (TRACE_ENABLED())
+			Tracer::Instant(TraceKind::Branch, name, TraceLine(), val);
+		scriptModule.ifResultStack.push(val);
+		return 0;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<NumericToken*>(params.at(0).get());
+	}
+};
+
+class IfFunction : public ConditionalFunction
+{
+public:
+
+	IfFunction() : ConditionalFunction("if"){}
+};
+
+class ElseFunction : public Function
+{
+
+public:
+	ElseFunction() : Function("else", 0) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		if (scriptModule.ifResultStack.empty())
+			throw ParseError("Error evaluating else statement (no if result detected)");
+		const auto ifResult = scriptModule.ifResultStack.top();
+		if (ifResult)
+		{
+			scriptModule.GoToLine(scriptModule.compiled->beginToEndMap.at(scriptModule.GetCurrentRunLine()));
+		}
+		return 0;
+	}
+	
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override { return true;}
+	
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		
+		if (scriptModule.nestStack.empty())
+		{
+			throw ParseError("Misplaced 'else' statement");
+		}
+		auto& top = scriptModule.nestStack.top();
+		if (top.name != "if" && top.name != "elseif")
+		{
+			throw ParseError("Missing 'if' for 'else' statement");
+		}
+		const auto curLine = scriptModule.GetCurrentCompileLine();
+		scriptModule.compiled->beginToEndMap[top.line] = curLine;
+		scriptModule.nestStack.pop();
+		scriptModule.nestStack.push(NestedBeginDeclaration("else", curLine));
+	}
+};
+
+class ElseIfFunction : public Function
+{
+
+public:
+	ElseIfFunction() : Function("elseif", 1) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		if (scriptModule.ifResultStack.empty())
+			throw ParseError("Error evaluating elseif statement (no if result detected)");
+		const auto ifResult = scriptModule.ifResultStack.top();
+		scriptModule.ifResultStack.pop();
+		const bool result = dynamic_cast<NumericToken*>(params.at(0).get())->Value();
+		if (TRACE_ENABLED())
+			Tracer::Instant(TraceKind::Branch, name, TraceLine(), !ifResult && result);
+		if (ifResult || !result)
+		{
+			scriptModule.GoToLine(scriptModule.compiled->beginToEndMap.at(scriptModule.GetCurrentRunLine()));
+		}
+		if (ifResult)
+			scriptModule.ifResultStack.push(true);
+		else
+			scriptModule.ifResultStack.push(result);
+		return 0;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<NumericToken*>(params.at(0).get());
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		if (scriptModule.nestStack.empty())
+		{
+			throw ParseError("Misplaced 'elseif' statement");
+		}
+		auto& top = scriptModule.nestStack.top();
+		if (top.name != "if" && top.name != "elseif")
+		{
+			throw ParseError("Missing 'if' for 'elseif' statement");
+		}
+		const auto curLine = scriptModule.GetCurrentCompileLine();
+		scriptModule.compiled->beginToEndMap[top.line] = curLine;
+		scriptModule.nestStack.pop();
+		scriptModule.nestStack.push(NestedBeginDeclaration("elseif", curLine));
+	}
+};
+
+class WhileFunction : public ConditionalFunction
+{
+public:
+
+	WhileFunction() : ConditionalFunction("while") {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		ConditionalFunction::Execute(params, scriptModule);
+		scriptModule.statistics.loopIterations += scriptModule.ifResultStack.top();
+		return 0;
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		ConditionalFunction::ValidateCompilation(scriptModule);
+		auto& top = scriptModule.nestStack.top();
+		auto topLine = top.line;
+		top.onEnd = [topLine](ScriptModule& mod)
+		{
+			if (!mod.ifResultStack.empty() && mod.ifResultStack.top())
+				mod.GoToLine(topLine);
+		};
+	}
+};
+
+// 'for <name> = <first> to <last> [step <step>]' ... 'end'. The bounds are evaluated once on entry; after that
+// only the 'end' line runs per iteration, stepping the loop variable in place and jumping back to the body.
+class ForFunction : public NestedFunction
+{
+public:
+
+	ForFunction() : NestedFunction("for", 4) {}
+
+	bool DefinesVariable() const override
+	{
+		return true;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto first = dynamic_cast<NumericToken*>(params.at(1).get())->Value();
+		const auto last = dynamic_cast<NumericToken*>(params.at(2).get())->Value();
+		const auto step = dynamic_cast<NumericToken*>(params.at(3).get())->Value();
+		if (step == 0)
+			throw ParseError("'for' step can't be 0");
+		auto counter = SetCounter(scriptModule, GetVariableName(params.at(0).get()), first);
+		const auto curLine = scriptModule.GetCurrentRunLine();
+		if (!ForLoopState::InRange(first, last, step))
+		{
+			scriptModule.GoToLine(scriptModule.compiled->beginToEndMap.at(static_cast<int>(curLine)) + 1);
+			return 0;
+		}
+		scriptModule.forLoopStack.push_back({std::move(counter), last, step, curLine + 1});
+		++scriptModule.statistics.loopIterations;
+		return 0;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return !GetVariableName(params.at(0).get()).empty() && dynamic_cast<NumericToken*>(params.at(1).get())
+			&& dynamic_cast<NumericToken*>(params.at(2).get()) && dynamic_cast<NumericToken*>(params.at(3).get());
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		NestedFunction::ValidateCompilation(scriptModule);
+		auto& top = scriptModule.nestStack.top();
+		top.hasIfResult = false;
+		top.onEnd = [](ScriptModule& mod)
+		{
+			mod.StepForLoop();
+		};
+	}
+
+private:
+	static std::shared_ptr<NumericVariable> SetCounter(ScriptModule& scriptModule, std::string_view name, double value)
+	{
+		if (const auto iter = scriptModule.scriptVariables.find(name); iter != scriptModule.scriptVariables.end())
+		{
+			if (auto counter = std::dynamic_pointer_cast<NumericVariable>(iter->second))
+			{
+				counter->data = value;
+				return counter;
+			}
+		}
+		auto counter = MakePooled<NumericVariable>(std::string(name), value);
+		ReplaceVariable(scriptModule, counter);
+		return counter;
+	}
+};
+
+class EndFunction : public Function
+{
+public:
+
+	EndFunction() : Function("end", 0) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule)
+	{
+		const auto curLine = scriptModule.GetCurrentRunLine();
+		auto& e = scriptModule.compiled->endToBeginMap.at(curLine);
+		if (e.execute)
+		{
+			e.execute(scriptModule);
+		}
+		if (e.hasIfResult)
+			scriptModule.ifResultStack.pop();
+		return 0;
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		if (scriptModule.nestStack.empty())
+		{
+			throw ParseError("'end' statement is missing a begin-type statement (if / while / for / def)");
+		}
+		const auto& top = scriptModule.nestStack.top();
+		const auto curLine = scriptModule.GetCurrentCompileLine();
+
+		scriptModule.compiled->beginToEndMap[top.line] = curLine;
+		auto& endToBegin = scriptModule.compiled->endToBeginMap[curLine];
+		endToBegin = EndToBegin(top.line, top.onEnd, top.hasIfResult);
+		endToBegin.stepsForLoop = top.name == "for";
+		for (const auto exitLine : top.loopExits)
+			scriptModule.compiled->loopExitMap[static_cast<int>(exitLine)].endLine = static_cast<int>(curLine);
+		scriptModule.nestStack.pop();
+	}
+};
+
+// 'generator <name> [<parameter> ...]' ... 'end' defines a generator; running into the definition skips it.
+// One object per generator, created while compiling; it only remembers where its body is.
+class GeneratorFunction : public NestedFunction
+{
+public:
+	std::vector<std::string> params;
+	std::size_t headerLine = 0;
+
+	GeneratorFunction(const std::string& generatorName, std::vector<std::string> params)
+		: NestedFunction("generator", 0), params(std::move(params)), generatorName(generatorName)
+	{
+	}
+
+	// parameters and the body's variables aren't assigned by name anywhere in the script
+	bool HasHiddenVariableAccess() const override
+	{
+		return true;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		scriptModule.GoToLine(scriptModule.compiled->beginToEndMap.at(static_cast<int>(scriptModule.GetCurrentRunLine())) + 1);
+		return 0;
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		if (!scriptModule.nestStack.empty())
+			throw ParseError("Generator '" + generatorName + "' must be defined outside of other blocks");
+		NestedFunction::ValidateCompilation(scriptModule);
+		scriptModule.nestStack.top().hasIfResult = false;
+		headerLine = scriptModule.GetCurrentCompileLine();
+	}
+
+private:
+	std::string generatorName;
+};
+
+// 'yield <value>' hands a value to the loop consuming the generator and suspends the generator until the loop
+// asks for the next one
+class YieldFunction : public Function
+{
+public:
+	YieldFunction() : Function("yield", 1) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		scriptModule.yieldedValue = Retain(params.at(0));
+		scriptModule.resumeLine = scriptModule.GetCurrentRunLine() + 1;
+		// past any line, which ends RunLines in the generator's frame
+		scriptModule.GoToLine(SIZE_MAX);
+		return 0;
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		auto nestStack = scriptModule.nestStack;
+		for (; !nestStack.empty(); nestStack.pop())
+		{
+			if (nestStack.top().name == "generator")
+				return;
+			if (nestStack.top().name == "parallel for")
+				throw ParseError("'yield' can't be used inside 'parallel for'");
+		}
+		throw ParseError("'yield' outside of a generator");
+	}
+};
+
+// The header of 'for <name> in <generator> ...'; created per generator since the number of arguments varies
+class GeneratorLoopFunction : public NestedFunction
+{
+public:
+	explicit GeneratorLoopFunction(GeneratorFunction* generator)
+		: NestedFunction("for in", generator->params.size() + 1), generator(generator)
+	{
+	}
+
+	bool DefinesVariable() const override
+	{
+		return true;
+	}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto curLine = scriptModule.GetCurrentRunLine();
+		GeneratorLoopState loop;
+		loop.frame = scriptModule.CreateFrame();
+		loop.variableName = std::string(GetVariableName(params.at(0).get()));
+		loop.bodyLine = curLine + 1;
+		loop.generatorEndLine = scriptModule.compiled->beginToEndMap.at(static_cast<int>(generator->headerLine));
+		loop.frame->resumeLine = generator->headerLine + 1;
+		{
+			ActiveModuleScope scope(*loop.frame);
+			for (auto i = 0u; i < generator->params.size(); ++i)
+				AssignVariable(generator->params[i], params.at(i + 1).get());
+		}
+		scriptModule.generatorLoopStack.push_back(std::move(loop));
+		if (!Advance(scriptModule))
+			scriptModule.GoToLine(scriptModule.compiled->beginToEndMap.at(static_cast<int>(curLine)) + 1);
+		return 0;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return !GetVariableName(params.at(0).get()).empty();
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		NestedFunction::ValidateCompilation(scriptModule);
+		auto& top = scriptModule.nestStack.top();
+		top.hasIfResult = false;
+		top.onEnd = [](ScriptModule& mod)
+		{
+			if (Advance(mod))
+				mod.GoToLine(mod.generatorLoopStack.back().bodyLine);
+		};
+	}
+
+	// Runs the generator of the innermost generator loop up to its next 'yield' and assigns the value to the
+	// loop variable. Once the generator finishes, the loop is removed and false is returned.
+	static bool Advance(ScriptModule& scriptModule)
+	{
+		auto& loop = scriptModule.generatorLoopStack.back();
+		auto& frame = *loop.frame;
+		frame.yieldedValue = nullptr;
+		try
+		{
+			ActiveModuleScope scope(frame);
+			frame.RunLines(frame.resumeLine, loop.generatorEndLine);
+		}
+		catch (const ParseError& e)
+		{
+			if (e.line != -1)
+				throw;
+			throw ParseError(e.what(), frame.SourceLine(frame.curRunLine));
+		}
+		scriptModule.statistics += frame.statistics;
+		frame.statistics = RunStatistics();
+		if (!frame.yieldedValue)
+		{
+			scriptModule.generatorLoopStack.pop_back();
+			return false;
+		}
+		AssignVariable(loop.variableName, frame.yieldedValue.get());
+		frame.yieldedValue = nullptr;
+		++scriptModule.statistics.loopIterations;
+		return true;
+	}
+
+private:
+	GeneratorFunction* generator;
+};
+
+// 'break' leaves the innermost loop, 'continue' goes on with its next iteration. The loop is found while
+// compiling; at runtime the statement unwinds the if blocks it is in and jumps to (past) the loop's 'end'.
+class LoopExitFunction : public Function
+{
+public:
+	explicit LoopExitFunction(const std::string& name)
+		: Function(name, 0), isBreak(name == "break")
+	{
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto& exit = scriptModule.compiled->loopExitMap.at(static_cast<int>(scriptModule.GetCurrentRunLine()));
+		for (auto i = 0; i < exit.ifDepth; ++i)
+			scriptModule.ifResultStack.pop();
+		if (!isBreak)
+		{
+			scriptModule.GoToLine(exit.endLine);
+			return 0;
+		}
+		if (exit.popsIfResult)
+			scriptModule.ifResultStack.pop();
+		if (exit.popsForLoop)
+			scriptModule.forLoopStack.pop_back();
+		if (exit.popsGeneratorLoop)
+			scriptModule.generatorLoopStack.pop_back();
+		scriptModule.GoToLine(exit.endLine + 1);
+		return 0;
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		if (!scriptModule.isCompiling)
+			throw ParseError("'" + name + "' can only be used in a compiled script");
+		// std::stack only exposes its top, so the blocks inside the loop are set aside and put back afterwards
+		auto& nestStack = scriptModule.nestStack;
+		std::vector<NestedBeginDeclaration> ifBlocks;
+		while (!nestStack.empty() && IsIfBlock(nestStack.top().name))
+		{
+			ifBlocks.push_back(std::move(nestStack.top()));
+			nestStack.pop();
+		}
+		std::string error;
+		if (nestStack.empty() || !IsLoop(nestStack.top().name))
+			error = "'" + name + "' outside of a loop";
+		else if (isBreak && nestStack.top().name == "parallel for")
+			error = "'break' can't leave a 'parallel for'";
+		else
+		{
+			auto& loop = nestStack.top();
+			const auto curLine = scriptModule.GetCurrentCompileLine();
+			loop.loopExits.push_back(curLine);
+			auto& exit = scriptModule.compiled->loopExitMap[static_cast<int>(curLine)];
+			exit = LoopExit();
+			exit.ifDepth = static_cast<int>(ifBlocks.size());
+			exit.popsIfResult = loop.hasIfResult;
+			exit.popsForLoop = loop.name == "for";
+			exit.popsGeneratorLoop = loop.name == "for in";
+		}
+		for (auto iter = ifBlocks.rbegin(); iter != ifBlocks.rend(); ++iter)
+			nestStack.push(std::move(*iter));
+		if (!error.empty())
+			throw ParseError(error);
+	}
+
+private:
+	bool isBreak;
+
+	static bool IsIfBlock(const std::string& name)
+	{
+		return name == "if" || name == "elseif" || name == "else";
+	}
+
+	static bool IsLoop(const std::string& name)
+	{
+		return name == "while" || name == "for" || name == "for in" || name == "parallel for";
+	}
+};
+
+class TrueFunction : public Function
+{
+public:
+
+	TrueFunction() : Function("true", 0) {}
+
+	bool IsPure() const override
+	{
+		return true;
+	}
+
+	bool HasNumericForm() const override
+	{
+		return true;
+	}
+
+	double ExecuteNumeric(const double* args) const override
+	{
+		return 1;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return 1;
+	}
+};
+
+class FalseFunction : public Function
+{
+public:
+
+	FalseFunction() : Function("false", 0) {}
+
+	bool IsPure() const override
+	{
+		return true;
+	}
+
+	bool HasNumericForm() const override
+	{
+		return true;
+	}
+
+	double ExecuteNumeric(const double* args) const override
+	{
+		return 0;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return 0;
+	}
+};
+
+class LineReader
+{
+public:
+	static constexpr std::size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+	LineReader() : buffer(DEFAULT_BUFFER_SIZE)
+	{
+	}
+
+	~LineReader()
+	{
+		Close();
+	}
+
+	bool Open(const std::string& fileName)
+	{
+		auto* newFile = std::fopen(fileName.c_str(), "rb");
+		if (!newFile)
+			return false;
+		Close();
+		file = newFile;
+		ownsFile = true;
+		return true;
+	}
+
+	void Close()
+	{
+		ReleaseViews();
+		if (ownsFile)
+			std::fclose(file);
+		file = stdin;
+		ownsFile = false;
+		streamEnd = false;
+		begin = end = 0;
+	}
+
+	bool AtEnd()
+	{
+		return begin == end && !Fill();
+	}
+
+	// The returned token points into the buffer and stays valid until the buffer is refilled,
+	// at which point any token still alive is given its own copy.
+	std::shared_ptr<StringViewToken> ReadLine()
+	{
+		auto scanFrom = begin;
+		while (true)
+		{
+			auto* lineEnd = static_cast<const char*>(std::memchr(buffer.data() + scanFrom, '\n', end - scanFrom));
+			if (lineEnd)
+			{
+				auto length = static_cast<std::size_t>(lineEnd - (buffer.data() + begin));
+				auto token = MakeView(length);
+				begin += length + 1;
+				return token;
+			}
+			scanFrom = end - begin;
+			if (!Fill())
+			{
+				auto token = MakeView(end - begin);
+				begin = end;
+				return token;
+			}
+			scanFrom += begin;
+		}
+	}
+
+	void Track(const std::shared_ptr<StringViewToken>& token)
+	{
+		if (liveViews.size() >= 32)
+		{
+			liveViews.erase(std::remove_if(liveViews.begin(), liveViews.end(),
+				[](const std::weak_ptr<StringViewToken>& view) { return view.expired(); }), liveViews.end());
+		}
+		liveViews.push_back(token);
+	}
+
+private:
+	std::FILE* file = stdin;
+	bool ownsFile = false;
+	bool streamEnd = false;
+	std::vector<char> buffer;
+	std::size_t begin = 0;
+	std::size_t end = 0;
+	std::vector<std::weak_ptr<StringViewToken>> liveViews;
+
+	std::shared_ptr<StringViewToken> MakeView(std::size_t length)
+	{
+		std::string_view line(buffer.data() + begin, length);
+		if (!line.empty() && line.back() == '\r')
+			line.remove_suffix(1);
+		auto token = MakePooled<StringViewToken>(line);
+		Track(token);
+		return token;
+	}
+
+	void ReleaseViews()
+	{
+		for (auto& view : liveViews)
+		{
+			if (auto token = view.lock())
+				token->Materialize();
+		}
+		liveViews.clear();
+	}
+
+	// Moves the unread tail to the front of the buffer and reads more after it; returns false if nothing was added
+	bool Fill()
+	{
+		if (streamEnd)
+			return false;
+		ReleaseViews();
+		const auto remaining = end - begin;
+		if (begin != 0)
+			std::memmove(buffer.data(), buffer.data() + begin, remaining);
+		begin = 0;
+		end = remaining;
+		if (end == buffer.size())
+			buffer.resize(buffer.size() * 2);
+		const auto read = std::fread(buffer.data() + end, 1, buffer.size() - end, file);
+		end += read;
+		if (read == 0)
+			streamEnd = true;
+		return read != 0;
+	}
+};
+
+LineReader s_inputReader;
+
+class OpenFunction : public Function
+{
+public:
+
+	OpenFunction() : Function("open", 1) {}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		auto* fileName = dynamic_cast<StringToken*>(params.at(0).get());
+		return s_inputReader.Open(fileName->ToString());
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get());
+	}
+};
+
+class EofFunction : public Function
+{
+public:
+
+	EofFunction() : Function("eof", 0) {}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return s_inputReader.AtEnd();
+	}
+};
+
+class ReadLineFunction : public StringFunction
+{
+public:
+
+	ReadLineFunction() : StringFunction("readline", 0) {}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	std::shared_ptr<StringToken> ExecuteString(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return s_inputReader.ReadLine();
+	}
+};
+
+std::string_view GetDelimiter(StringToken* token)
+{
+	const auto delimiter = token->View();
+	if (delimiter == "\\t")
+		return "\t";
+	return delimiter;
+}
+
+// Splits like awk: an empty delimiter separates fields by runs of whitespace
+template <typename Callback>
+void ForEachField(std::string_view str, std::string_view delimiter, Callback&& callback)
+{
+	if (delimiter.empty())
+	{
+		std::size_t pos = 0;
+		while (true)
+		{
+			while (pos < str.size() && isspace(static_cast<unsigned char>(str[pos])))
+				++pos;
+			if (pos == str.size())
+				return;
+			auto fieldEnd = pos;
+			while (fieldEnd < str.size() && !isspace(static_cast<unsigned char>(str[fieldEnd])))
+				++fieldEnd;
+			if (!callback(str.substr(pos, fieldEnd - pos)))
+				return;
+			pos = fieldEnd;
+		}
+	}
+	std::size_t pos = 0;
+	while (true)
+	{
+		const auto fieldEnd = str.find(delimiter, pos);
+		if (fieldEnd == std::string_view::npos)
+		{
+			callback(str.substr(pos));
+			return;
+		}
+		if (!callback(str.substr(pos, fieldEnd - pos)))
+			return;
+		pos = fieldEnd + delimiter.size();
+	}
+}
+
+class FieldFunction : public StringFunction
+{
+public:
+
+	FieldFunction() : StringFunction("field", 3) {}
+
+	bool IsPure() const override
+	{
+		return true;
+	}
+
+	std::shared_ptr<StringToken> ExecuteString(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		auto* source = dynamic_cast<StringToken*>(params.at(0).get());
+		const auto delimiter = GetDelimiter(dynamic_cast<StringToken*>(params.at(1).get()));
+		const auto index = static_cast<int>(dynamic_cast<NumericToken*>(params.at(2).get())->Value());
+		const auto str = source->View();
+
+		std::string_view result;
+		if (index == 0)
+		{
+			result = str;
+		}
+		else if (index > 0)
+		{
+			auto cur = 0;
+			ForEachField(str, delimiter, [&](std::string_view field)
+			{
+				if (++cur != index)
+					return true;
+				result = field;
+				return false;
+			});
+		}
+
+		// fields of a line that still lives in the input buffer are handed out as views as well
+		auto* view = dynamic_cast<StringViewToken*>(source);
+		if (view && !view->isMaterialized)
+		{
+			auto token = MakePooled<StringViewToken>(result);
+			s_inputReader.Track(token);
+			return token;
+		}
+		return MakeString(result);
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get()) && dynamic_cast<StringToken*>(params.at(1).get())
+			&& dynamic_cast<NumericToken*>(params.at(2).get());
+	}
+};
+
+class NumFieldsFunction : public Function
+{
+public:
+
+	NumFieldsFunction() : Function("nfields", 2) {}
+
+	bool IsPure() const override
+	{
+		return true;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto str = dynamic_cast<StringToken*>(params.at(0).get())->View();
+		const auto delimiter = GetDelimiter(dynamic_cast<StringToken*>(params.at(1).get()));
+		auto count = 0;
+		ForEachField(str, delimiter, [&](std::string_view)
+		{
+			++count;
+			return true;
+		});
+		return count;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get()) && dynamic_cast<StringToken*>(params.at(1).get());
+	}
+};
+
+class NumFunction : public Function
+{
+public:
+
+	NumFunction() : Function("num", 1) {}
+
+	bool IsPure() const override
+	{
+		return true;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		if (auto* numericToken = dynamic_cast<NumericToken*>(params.at(0).get()))
+			return numericToken->Value();
+		double result = 0;
+		ParseNumber(dynamic_cast<StringToken*>(params.at(0).get())->View(), result);
+		return result;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get()) || dynamic_cast<NumericToken*>(params.at(0).get());
+	}
+};
+
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& fileName)
+	{
+#ifdef KSCRIPT_HAS_MMAP
+		const auto fd = ::open(fileName.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st{};
+		if (::fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			auto* mapped = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED)
+			{
+				::madvise(mapped, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+				data = static_cast<const char*>(mapped);
+				size = static_cast<std::size_t>(st.st_size);
+			}
+		}
+		isOpen = true;
+		::close(fd);
+#else
+		std::ifstream is(fileName, std::ios::binary);
+		if (!is)
+			return;
+		contents.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+		data = contents.data();
+		size = contents.size();
+		isOpen = true;
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef KSCRIPT_HAS_MMAP
+		if (data)
+			::munmap(const_cast<char*>(data), size);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data = nullptr;
+	std::size_t size = 0;
+	bool isOpen = false;
+
+private:
+#ifndef KSCRIPT_HAS_MMAP
+	std::vector<char> contents;
+#endif
+};
+
+class CsvChunk
+{
+public:
+	std::vector<std::vector<double>> numbers;
+	std::vector<std::vector<StringValue>> strings;
+	std::vector<bool> isNumeric;
+};
+
+std::string_view NextCsvLine(const char*& pos, const char* end)
+{
+	// an empty file is mapped as nullptr, which memchr must not be given even for zero bytes
+	if (pos == end)
+		return {};
+	auto* lineEnd = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+	if (!lineEnd)
+		lineEnd = end;
+	std::string_view line(pos, lineEnd - pos);
+	pos = lineEnd == end ? end : lineEnd + 1;
+	if (!line.empty() && line.back() == '\r')
+		line.remove_suffix(1);
+	return line;
+}
+
+// Columns flagged in asStrings are collected as text, all others are parsed as numbers
+void ParseCsvChunk(const char* begin, const char* end, std::string_view delimiter, const std::vector<bool>& asStrings, CsvChunk& chunk)
+{
+	const auto numColumns = asStrings.size();
+	chunk.numbers.resize(numColumns);
+	chunk.strings.resize(numColumns);
+	chunk.isNumeric.assign(numColumns, true);
+	while (begin < end)
+	{
+		const auto line = NextCsvLine(begin, end);
+		if (line.empty())
+			continue;
+		auto column = 0u;
+		ForEachField(line, delimiter, [&](std::string_view cell)
+		{
+			if (column == numColumns)
+				return false;
+			if (asStrings[column])
+			{
+				chunk.strings[column].emplace_back(cell);
+			}
+			else
+			{
+				double value = 0;
+				if (!ParseNumber(cell, value) && !cell.empty())
+					chunk.isNumeric[column] = false;
+				chunk.numbers[column].push_back(value);
+			}
+			++column;
+			return true;
+		});
+		for (; column < numColumns; ++column)
+		{
+			if (asStrings[column])
+				chunk.strings[column].emplace_back();
+			else
+				chunk.numbers[column].push_back(0);
+		}
+	}
+}
+
+class LoadCsvFunction : public Function
+{
+public:
+	static constexpr std::size_t MIN_CHUNK_SIZE = 1 << 22;
+
+	LoadCsvFunction() : Function("loadcsv", 2) {}
+
+	bool HasHiddenVariableAccess() const override
+	{
+		return true;
+	}
+
+	// Defines one array variable per header column and returns the number of rows
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto fileName = dynamic_cast<StringToken*>(params.at(0).get())->ToString();
+		const auto delimiter = GetDelimiter(dynamic_cast<StringToken*>(params.at(1).get()));
+		MappedFile file(fileName);
+		if (!file.isOpen)
+			throw ParseError("Could not open file " + fileName);
+
+		const auto* pos = file.data;
+		const auto* end = file.data + file.size;
+		std::vector<std::string> names;
+		ForEachField(NextCsvLine(pos, end), delimiter, [&](std::string_view header)
+		{
+			std::string name(header);
+			for (auto& ch : name)
+			{
+				if (!isalnum(static_cast<unsigned char>(ch)))
+					ch = '_';
+			}
+			names.push_back(std::move(name));
+			return true;
+		});
+
+		const auto chunks = SplitChunks(pos, end);
+		std::vector<bool> asStrings(names.size(), false);
+		auto results = ParseChunks(chunks, delimiter, asStrings);
+
+		// columns that turned out not to be numeric are parsed once more as text
+		std::vector<bool> retry(names.size(), false);
+		auto needsRetry = false;
+		for (auto& result : results)
+		{
+			for (auto i = 0u; i < names.size(); ++i)
+			{
+				if (!result.isNumeric[i])
+					retry[i] = needsRetry = true;
+			}
+		}
+		std::vector<CsvChunk> stringResults;
+		if (needsRetry)
+			stringResults = ParseChunks(chunks, delimiter, retry);
+
+		std::size_t numRows = 0;
+		for (auto i = 0u; i < names.size(); ++i)
+		{
+			auto array = MakePooled<ArrayVariable>(names[i]);
+			array->isNumeric = !retry[i];
+			for (auto c = 0u; c < chunks.size(); ++c)
+			{
+				if (array->isNumeric)
+				{
+					auto& column = results[c].numbers[i];
+					array->numbers.insert(array->numbers.end(), column.begin(), column.end());
+				}
+				else
+				{
+					auto& column = stringResults[c].strings[i];
+					std::move(column.begin(), column.end(), std::back_inserter(array->strings));
+				}
+			}
+			array->ChargeElements();
+			numRows = array->Size();
+			ReplaceVariable(scriptModule, std::move(array));
+		}
+		return static_cast<double>(numRows);
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get()) && dynamic_cast<StringToken*>(params.at(1).get());
+	}
+
+private:
+	using Chunk = std::pair<const char*, const char*>;
+
+	// Splits the body on line boundaries into roughly equal pieces, one per hardware thread
+	static std::vector<Chunk> SplitChunks(const char* begin, const char* end)
+	{
+		const auto size = static_cast<std::size_t>(end - begin);
+		auto numChunks = std::max<std::size_t>(1, std::min<std::size_t>(std::thread::hardware_concurrency(), size / MIN_CHUNK_SIZE));
+		std::vector<Chunk> chunks;
+		auto* chunkBegin = begin;
+		for (auto i = 1u; i <= numChunks && chunkBegin < end; ++i)
+		{
+			auto* chunkEnd = i == numChunks ? end : begin + size / numChunks * i;
+			if (chunkEnd < chunkBegin)
+				chunkEnd = chunkBegin;
+			if (chunkEnd != end)
+			{
+				auto* lineEnd = static_cast<const char*>(std::memchr(chunkEnd, '\n', end - chunkEnd));
+				chunkEnd = lineEnd ? lineEnd + 1 : end;
+			}
+			chunks.emplace_back(chunkBegin, chunkEnd);
+			chunkBegin = chunkEnd;
+		}
+		return chunks;
+	}
+
+	static std::vector<CsvChunk> ParseChunks(const std::vector<Chunk>& chunks, std::string_view delimiter, const std::vector<bool>& asStrings)
+	{
+		std::vector<CsvChunk> results(chunks.size());
+		std::vector<std::thread> threads;
+		for (auto i = 1u; i < chunks.size(); ++i)
+		{
+			threads.emplace_back([&, i]
+			{
+				ParseCsvChunk(chunks[i].first, chunks[i].second, delimiter, asStrings, results[i]);
+			});
+		}
+		if (!chunks.empty())
+			ParseCsvChunk(chunks[0].first, chunks[0].second, delimiter, asStrings, results[0]);
+		for (auto& thread : threads)
+			thread.join();
+		return results;
+	}
+};
+
+class ArrayFunction : public Function
+{
+public:
+	ArrayFunction(const std::string& name, std::size_t numParams)
+		: Function(name, numParams)
+	{
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<ArrayVariableToken*>(params.at(0).get());
+	}
+
+protected:
+	static ArrayVariable* GetArray(const std::vector<std::shared_ptr<OperandToken>>& params)
+	{
+		return dynamic_cast<ArrayVariableToken*>(params.at(0).get())->variable;
+	}
+};
+
+class LenFunction : public ArrayFunction
+{
+public:
+
+	LenFunction() : ArrayFunction("len", 1) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return static_cast<double>(GetArray(params)->Size());
+	}
+};
+
+class AtFunction : public ArrayFunction
+{
+public:
+
+	AtFunction() : ArrayFunction("at", 2) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return GetArray(params)->numbers[GetIndex(params)];
+	}
+
+	std::shared_ptr<OperandToken> Call(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		auto* array = GetArray(params);
+		if (!array->isNumeric)
+			return MakeString(array->strings[GetIndex(params)]);
+		return Function::Call(params, scriptModule);
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return ArrayFunction::ValidateParams(params) && dynamic_cast<NumericToken*>(params.at(1).get());
+	}
+
+private:
+	static std::size_t GetIndex(const std::vector<std::shared_ptr<OperandToken>>& params)
+	{
+		const auto index = dynamic_cast<NumericToken*>(params.at(1).get())->Value();
+		if (index < 0 || index >= static_cast<double>(GetArray(params)->Size()))
+			throw ParseError("Array index " + ToString(index) + " is out of bounds");
+		return static_cast<std::size_t>(index);
+	}
+};
+
+class ColumnSumFunction : public ArrayFunction
+{
+public:
+
+	ColumnSumFunction() : ArrayFunction("colsum", 1) {}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		auto* array = GetArray(params);
+		if (!array->isNumeric)
+			throw ParseError("Cannot sum a non-numeric array");
+		double result = 0;
+		for (const auto value : array->numbers)
+			result += value;
+		return result;
+	}
+};
+
+class SnapshotFunction : public Function
+{
+public:
+
+	SnapshotFunction() : Function("snapshot", 1) {}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	bool HasHiddenVariableAccess() const override
+	{
+		return true;
+	}
+
+	// Resuming from the snapshot continues on the line after this call
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto fileName = dynamic_cast<StringToken*>(params.at(0).get())->ToString();
+		std::ofstream os(fileName, std::ios::binary);
+		if (!os)
+			return 0;
+		scriptModule.SaveSnapshot(os);
+		return os.good();
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get());
+	}
+};
+
+// Base for native functions that wait on the host, e.g. a cache lookup or a disk read. Start begins the operation
+// and returns; the host completes the call later, from any thread. Meanwhile the script is suspended on the
+// calling line, and the thread is free to run other scripts. Once resumed, the line is evaluated again and the
+// call returns its result. Everything before the call on that line runs again too, so the line may only call
+// pure functions before it, and one async function at most.
+class AsyncFunction : public Function
+{
+public:
+	AsyncFunction(const std::string& name, std::size_t numParams)
+		: Function(name, numParams)
+	{
+	}
+
+	virtual void Start(const std::vector<std::shared_ptr<OperandToken>>& params, std::shared_ptr<AsyncCall> call) = 0;
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		return 0;
+	}
+
+	std::shared_ptr<OperandToken> Call(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		if (scriptModule.completedCall)
+		{
+			const auto call = std::move(scriptModule.completedCall);
+			auto result = call->TakeResult();
+			// the result was built on another thread, outside of the script's memory account
+			if (auto* str = dynamic_cast<StringConstantToken*>(result.get()))
+				str->value.ChargeTo(&scriptModule.Memory());
+			return result;
+		}
+		auto call = std::make_shared<AsyncCall>();
+		Start(params, call);
+		scriptModule.pendingCall = std::move(call);
+		throw ScriptSuspended();
+	}
+
+	void ValidateCompilation(ScriptModule& scriptModule) override
+	{
+		auto nestStack = scriptModule.nestStack;
+		for (; !nestStack.empty(); nestStack.pop())
+		{
+			if (nestStack.top().name == "generator")
+				throw ParseError("'" + name + "' can't be used inside a generator");
+		}
+	}
+};
+
+// Runs blocking host work off the interpreter's thread, one task after the other
+class BackgroundWorker
+{
+public:
+	static BackgroundWorker& Get()
+	{
+		static BackgroundWorker worker;
+		return worker;
+	}
+
+	~BackgroundWorker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_one();
+		thread.join();
+	}
+
+	void Post(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		wakeUp.notify_one();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<std::function<void()>> tasks;
+	bool stopping = false;
+	std::thread thread;
+
+	BackgroundWorker()
+		: thread([this] { Run(); })
+	{
+	}
+
+	void Run()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+// 'readfile <path>' returns the contents of a file, read on the background worker
+class ReadFileFunction : public AsyncFunction
+{
+public:
+	ReadFileFunction() : AsyncFunction("readfile", 1) {}
+
+	void Start(const std::vector<std::shared_ptr<OperandToken>>& params, std::shared_ptr<AsyncCall> call) override
+	{
+		auto fileName = dynamic_cast<StringToken*>(params.at(0).get())->ToString();
+		BackgroundWorker::Get().Post([fileName = std::move(fileName), call = std::move(call)]
+		{
+			std::ifstream is(fileName, std::ios::binary);
+			if (!is)
+			{
+				call->Fail("Could not open " + fileName);
+				return;
+			}
+			std::ostringstream contents;
+			contents << is.rdbuf();
+			call->Complete(MakeString(StringValue(contents.str())));
+		});
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return dynamic_cast<StringToken*>(params.at(0).get());
+	}
+};
+
+// Runs numbered tasks on a fixed set of threads. Every thread starts with its own contiguous share of the
+// task numbers and, once that is used up, steals tasks from the far end of the other threads' shares.
+class WorkStealingPool
+{
+public:
+	using Task = std::function<void(std::size_t task, std::size_t worker)>;
+
+	static WorkStealingPool& Get()
+	{
+		static WorkStealingPool pool(std::max(1u, std::thread::hardware_concurrency()));
+		return pool;
+	}
+
+	explicit WorkStealingPool(std::size_t numWorkers)
+		: queues(numWorkers)
+	{
+		for (auto i = 0u; i < numWorkers; ++i)
+			workers.emplace_back([this, i] { WorkerLoop(i); });
+	}
+
+	~WorkStealingPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wakeUp.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	std::size_t NumWorkers() const
+	{
+		return workers.size();
+	}
+
+	// Calls task(task, worker) for every task number below numTasks and returns once all calls are done. Tasks
+	// must not throw.
+	void Run(std::size_t numTasks, const Task& task)
+	{
+		std::lock_guard<std::mutex> runLock(runMutex);
+		std::unique_lock<std::mutex> lock(mutex);
+		for (auto i = 0u; i < queues.size(); ++i)
+		{
+			std::lock_guard<std::mutex> queueLock(queues[i].mutex);
+			queues[i].begin = numTasks * i / queues.size();
+			queues[i].end = numTasks * (i + 1) / queues.size();
+		}
+		job = &task;
+		completed = 0;
+		++generation;
+		wakeUp.notify_all();
+		done.wait(lock, [&] { return completed == numTasks && active == 0; });
+		job = nullptr;
+	}
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::size_t begin = 0;
+		std::size_t end = 0;
+	};
+
+	std::vector<Queue> queues;
+	std::vector<std::thread> workers;
+	std::mutex runMutex;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::condition_variable done;
+	const Task* job = nullptr;
+	std::size_t generation = 0;
+	std::size_t completed = 0;
+	std::size_t active = 0;
+	bool stop = false;
+
+	bool TakeTask(std::size_t worker, std::size_t& task)
+	{
+		{
+			auto& own = queues[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (own.begin < own.end)
+			{
+				task = own.begin++;
+				return true;
+			}
+		}
+		for (auto i = 1u; i < queues.size(); ++i)
+		{
+			auto& victim = queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.begin < victim.end)
+			{
+				task = --victim.end;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void WorkerLoop(std::size_t worker)
+	{
+		std::size_t seenGeneration = 0;
+		for (;;)
+		{
+			const Task* task = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [&] { return stop || generation != seenGeneration; });
+				if (stop)
+					return;
+				seenGeneration = generation;
+				task = job;
+				++active;
+			}
+			std::size_t numDone = 0;
+			for (std::size_t taskIndex; task && TakeTask(worker, taskIndex); ++numDone)
+				(*task)(taskIndex, worker);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				completed += numDone;
+				--active;
+			}
+			done.notify_all();
+		}
+	}
+};
+
+// 'parallel for <name> = <first> to <last> [step <step>] [reduce <sum|min|max|concat> <name>, ...]' ... 'end'
+// The iterations are split into chunks that run on the work stealing pool, each in a private frame of
+// variables: the body reads the script's variables, but whatever it assigns is discarded afterwards, the loop
+// variable included. Reduction variables start each chunk at their neutral value (0, +inf, -inf or "") and
+// the results of the chunks are combined in iteration order and with the variable's value before the loop.
+// Printed output is buffered per chunk and written in iteration order as well.
+class ParallelForFunction : public NestedFunction
+{
+public:
+	static constexpr std::size_t CHUNKS_PER_WORKER = 8;
+
+	enum class ReductionType
+	{
+		Sum,
+		Min,
+		Max,
+		Concat
+	};
+
+	struct Reduction
+	{
+		ReductionType type;
+		std::string name;
+	};
+
+	ParallelForFunction() : NestedFunction("parallel for", 5) {}
+
+	bool HasHiddenVariableAccess() const override
+	{
+		return true;
+	}
+
+	bool IsThreadSafe() const override
+	{
+		return false;
+	}
+
+	// Parses 'sum total, max best' into the reduction list; also used to check the declaration when compiling
+	static std::vector<Reduction> ParseReductions(std::string_view spec)
+	{
+		std::vector<Reduction> reductions;
+		while (!spec.empty())
+		{
+			const auto comma = spec.find(',');
+			auto item = spec.substr(0, comma);
+			spec = comma == std::string_view::npos ? std::string_view() : spec.substr(comma + 1);
+
+			std::vector<std::string_view> words;
+			ForEachField(item, "", [&](std::string_view word)
+			{
+				words.push_back(word);
+				return true;
+			});
+			if (words.size() != 2)
+				throw ParseError("Expected '<sum|min|max|concat> <variable>' in reduce list");
+			Reduction reduction{ReductionType::Sum, std::string(words[1])};
+			if (words[0] == "sum")
+				reduction.type = ReductionType::Sum;
+			else if (words[0] == "min")
+				reduction.type = ReductionType::Min;
+			else if (words[0] == "max")
+				reduction.type = ReductionType::Max;
+			else if (words[0] == "concat")
+				reduction.type = ReductionType::Concat;
+			else
+				throw ParseError("Unknown reduction '" + std::string(words[0]) + "'");
+			reductions.push_back(std::move(reduction));
+		}
+		return reductions;
+	}
+
+	double Execute(const std::vector<std::shared_ptr<OperandToken>>& params, ScriptModule& scriptModule) override
+	{
+		const auto headerLine = scriptModule.GetCurrentRunLine();
+		const auto endLine = static_cast<std::size_t>(scriptModule.compiled->beginToEndMap.at(static_cast<int>(headerLine)));
+		scriptModule.GoToLine(endLine + 1);
+		CheckBody(scriptModule, headerLine + 1, endLine);
+
+		const std::string name(GetVariableName(params.at(0).get()));
+		const auto first = dynamic_cast<NumericToken*>(params.at(1).get())->Value();
+		const auto last = dynamic_cast<NumericToken*>(params.at(2).get())->Value();
+		const auto step = dynamic_cast<NumericToken*>(params.at(3).get())->Value();
+		const auto reductions = ParseReductions(dynamic_cast<StringToken*>(params.at(4).get())->View());
+		if (step == 0)
+			throw ParseError("'parallel for' step can't be 0");
+		if (!ForLoopState::InRange(first, last, step))
+			return 0;
+		const auto numIterations = static_cast<std::size_t>(std::floor((last - first) / step)) + 1;
+
+		// loop bodies only read the variables of enclosing scopes, so their shared tokens must exist beforehand
+		for (auto* scope = &scriptModule; scope; scope = scope->outerScope)
+		{
+			for (auto& variable : scope->scriptVariables)
+				GetVariableToken(variable.second.get());
+		}
+
+		// nested loops run on the thread of the enclosing iteration
+		auto& pool = WorkStealingPool::Get();
+		const auto isNested = scriptModule.outerScope != nullptr;
+		const auto numWorkers = isNested ? 1 : pool.NumWorkers();
+		const auto numChunks = std::min(numIterations, numWorkers * CHUNKS_PER_WORKER);
+
+		std::vector<std::unique_ptr<ScriptModule>> frames(numWorkers);
+		std::vector<std::string> outputs(numChunks);
+		std::vector<std::vector<std::shared_ptr<Variable>>> partials(numChunks);
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		auto errorChunk = numChunks;
+		std::atomic<bool> failed{false};
+		// the error of the earliest chunk is the one a sequential loop would have run into
+		const auto fail = [&](std::size_t chunk, std::exception_ptr chunkError)
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (chunk < errorChunk)
+			{
+				errorChunk = chunk;
+				error = std::move(chunkError);
+			}
+			failed = true;
+		};
+
+		const WorkStealingPool::Task runChunk = [&](std::size_t chunk, std::size_t worker)
+		{
+			if (failed)
+				return;
+			auto& frame = frames[worker];
+			if (!frame)
+				frame = scriptModule.CreateFrame();
+			ActiveModuleScope scope(*frame);
+			// a nested loop's chunks run inside a chunk of the enclosing loop, whose buffer gets their output
+			auto* enclosingCapture = ScriptOutput::CaptureThread(&outputs[chunk]);
+			try
+			{
+				const auto firstIteration = numIterations * chunk / numChunks;
+				RunChunk(*frame, name, first + step * static_cast<double>(firstIteration), step,
+					numIterations * (chunk + 1) / numChunks - firstIteration, headerLine + 1, endLine, reductions, partials[chunk]);
+			}
+			catch (const ParseError& e)
+			{
+				fail(chunk, std::make_exception_ptr(ParseError(e.what(), e.line != -1 ? e.line : frame->SourceLine(frame->curRunLine))));
+			}
+			catch (...)
+			{
+				fail(chunk, std::current_exception());
+			}
+			ScriptOutput::CaptureThread(enclosingCapture);
+		};
+		if (isNested)
+		{
+			for (auto chunk = 0u; chunk < numChunks; ++chunk)
+				runChunk(chunk, 0);
+		}
+		else
+		{
+			pool.Run(numChunks, runChunk);
+		}
+
+		for (auto chunk = 0u; chunk < errorChunk; ++chunk)
+			s_output.Write(outputs[chunk]);
+		for (const auto& frame : frames)
+		{
+			if (frame)
+				scriptModule.statistics += frame->statistics;
+		}
+		if (error)
+			std::rethrow_exception(error);
+		scriptModule.statistics.loopIterations += numIterations;
+		Combine(scriptModule, reductions, partials);
+		return 0;
+	}
+
+	bool ValidateParams(const std::vector<std::shared_ptr<OperandToken>>& params) override
+	{
+		return !GetVariableName(params.at(0).get()).empty() && dynamic_cast<NumericToken*>(params.at(1).get())
+			&& dynamic_cast<NumericToken*>(params.at(2).get()) && dynamic_cast<NumericToken*>(params.at(3).get())
+			&& dynamic_cast<StringToken*>(params.at(4).get());
+	}
+
+private:
+	static void CheckBody(ScriptModule& scriptModule, std::size_t fromLine, std::size_t toLine)
+	{
+		for (auto line = fromLine; line < toLine; ++line)
+		{
+			for (auto& token : scriptModule.compiled->scriptRunLines[line].Code())
+			{
+				auto* function = dynamic_cast<FunctionCallToken*>(token.get());
+				if (function && !function->Value()->IsThreadSafe() && !dynamic_cast<ParallelForFunction*>(function->Value()))
+					throw ParseError("'" + function->Value()->name + "' can't be used inside 'parallel for'", scriptModule.SourceLine(line));
+			}
+		}
+	}
+
+	static double GetNeutralValue(ReductionType type)
+	{
+		if (type == ReductionType::Min)
+			return std::numeric_limits<double>::infinity();
+		if (type == ReductionType::Max)
+			return -std::numeric_limits<double>::infinity();
+		return 0;
+	}
+
+	static std::shared_ptr<Variable> MakeNeutral(const Reduction& reduction)
+	{
+		if (reduction.type == ReductionType::Concat)
+			return MakePooled<StringVariable>(reduction.name, StringValue());
+		return MakePooled<NumericVariable>(reduction.name, GetNeutralValue(reduction.type));
+	}
+
+	static void RunChunk(ScriptModule& frame, const std::string& name, double first, double step, std::size_t numIterations,
+		std::size_t fromLine, std::size_t toLine, const std::vector<Reduction>& reductions,
+		std::vector<std::shared_ptr<Variable>>& results)
+	{
+		frame.scriptVariables.clear();
+		frame.ifResultStack = {};
+		for (const auto& reduction : reductions)
+			frame.scriptVariables[reduction.name] = MakeNeutral(reduction);
+		const auto loopVariable = MakePooled<NumericVariable>(name, first);
+		for (auto i = 0u; i < numIterations; ++i)
+		{
+			auto& slot = frame.scriptVariables[name];
+			if (slot != loopVariable)
+				slot = loopVariable;
+			loopVariable->data = first + step * i;
+			frame.RunLines(fromLine, toLine);
+		}
+		for (const auto& reduction : reductions)
+		{
+			auto& result = frame.scriptVariables[reduction.name];
+			const auto isString = dynamic_cast<StringVariable*>(result.get()) != nullptr;
+			if ((!dynamic_cast<NumericVariable*>(result.get()) && !isString) || isString != (reduction.type == ReductionType::Concat))
+				throw ParseError("Reduction variable '" + reduction.name + "' changed its type");
+			results.push_back(result);
+		}
+	}
+
+	static void Combine(ScriptModule& scriptModule, const std::vector<Reduction>& reductions,
+		const std::vector<std::vector<std::shared_ptr<Variable>>>& partials)
+	{
+		for (auto r = 0u; r < reductions.size(); ++r)
+		{
+			const auto& reduction = reductions[r];
+			auto* initial = scriptModule.FindVariable(reduction.name);
+			if (reduction.type == ReductionType::Concat)
+			{
+				StringValue value;
+				if (auto* strVar = dynamic_cast<StringVariable*>(initial))
+					value = strVar->data;
+				for (const auto& partial : partials)
+					value = StringValue::Concat(value, static_cast<StringVariable*>(partial[r].get())->data.View());
+				scriptModule.scriptVariables[reduction.name] = MakePooled<StringVariable>(reduction.name, std::move(value));
+				continue;
+			}
+			auto* numVar = dynamic_cast<NumericVariable*>(initial);
+			auto value = numVar ? numVar->data : GetNeutralValue(reduction.type);
+			for (const auto& partial : partials)
+			{
+				const auto x = static_cast<NumericVariable*>(partial[r].get())->data;
+				if (reduction.type == ReductionType::Sum)
+					value += x;
+				else if (reduction.type == ReductionType::Min)
+					value = std::min(value, x);
+				else
+					value = std::max(value, x);
+			}
+			scriptModule.scriptVariables[reduction.name] = MakePooled<NumericVariable>(reduction.name, value);
+		}
+	}
+
+};
+
+std::vector<Function*> s_functions =
+{
+	new SqrtFunction(),
+	new PrintFunction(),
+	new WriteFunction(),
+	new OutputFunction(),
+	new IfFunction(),
+	new ElseFunction(),
+	new ElseIfFunction(),
+	new EndFunction(),
+	new WhileFunction(),
+	new ForFunction(),
+	new LoopExitFunction("break"),
+	new LoopExitFunction("continue"),
+	new YieldFunction(),
+	new TrueFunction(),
+	new FalseFunction(),
+	new OpenFunction(),
+	new EofFunction(),
+	new ReadLineFunction(),
+	new FieldFunction(),
+	new NumFieldsFunction(),
+	new NumFunction(),
+	new LoadCsvFunction(),
+	new LenFunction(),
+	new AtFunction(),
+	new ColumnSumFunction(),
+	new SnapshotFunction(),
+	new ReadFileFunction(),
+	new ParallelForFunction(),
+};
+
+class StringIterator
+{
+public:
+	std::string string;
+	unsigned int pos = 0;
+
+	char Peek()
+	{
+		return string.at(pos);
+	}
+
+	char Seek()
+	{
+		return string.at(pos++);
+	}
+
+	bool End() const
+	{
+		return pos == string.size();
+	}
+
+	explicit StringIterator(std::string string)
+		: string(std::move(string))
+	{
+	}
+
+	void Advance()
+	{
+		++pos;
+	}
+
+	std::string GetStringInQuotationMarks()
+	{
+		Advance();
+		auto fPos = string.find_first_of('"', this->pos);
+		if (fPos == std::string::npos)
+			throw ParseError("Mismatched quotation marks (\")");
+		auto ret = string.substr(pos, fPos - pos);
+		pos = fPos + 1;
+		return ret;
+	}
+
+	std::string GetCurOperandString()
+	{
+		std::string result;
+		while (!End())
+		{
+			const auto ch = Peek();
+			if (isspace(static_cast<unsigned char>(ch)) || ispunct(static_cast<unsigned char>(ch)) && ch != '_')
+				break;
+			Advance();
+			result += ch;
+		}
+		return result;
+	}
+
+	std::string GetCurOperatorString()
+	{
+		std::string result;
+		while (!End())
+		{
+			const auto ch = Peek();
+			if (isalnum(ch) || isspace(ch) || ch == '"')
+				break;
+			Advance();
+			result += ch;
+			if (ch == '(' || ch == ')')
+				return result;
+		}
+		return result;
+	}
+
+	Operator* FindOperator(const std::string& opStr)
+	{
+		for (auto& op : s_operators)
+		{
+			if (op->operator_ == opStr)
+			{
+				return op;
+			}
+		}
+		return nullptr;
+	}
+
+	std::shared_ptr<OperatorToken> ParseOperator()
+	{
+		auto opStr = GetCurOperatorString();
+		if (opStr.empty())
+		{
+			return nullptr;
+		}
+		if (opStr.size() > 2)
+			throw ParseError("Failed to parse operator " + opStr);
+		auto* op = FindOperator(opStr);
+		if (op)
+			return std::make_shared<OperatorToken>(op);
+		throw ParseError("Unsupported operator " + opStr);
+	}
+	
+};
+
+std::shared_ptr<OperandToken> ParseNumericConstant(const std::string& opStr)
+{
+	try
+	{
+		const auto num = std::stod(opStr);
+		return Numeric(num);
+	}
+	catch (std::invalid_argument&)
+	{
+	}
+	return nullptr;
+}
+
+std::shared_ptr<FunctionCallToken> ParseFunctionCall(const std::string& opStr)
+{
+	for (auto* iter : s_functions)
+	{
+		if (iter->name == opStr)
+		{
+			return std::make_shared<FunctionCallToken>(iter);
+		}
+	}
+	return nullptr;
+}
+
+OperandToken* ParseVariableToken(std::string_view opStr)
+{
+	if (auto* variable = t_activeModule->FindVariable(opStr))
+	{
+		return GetVariableToken(variable).get();
+	}
+	return nullptr;
+}
+
+bool IsOpenBracket(OperatorOrFunctionCallToken* token)
+{
+	if (auto* op = dynamic_cast<Operator*>(token->value))
+		return op->operator_ == "(";
+	return false;
+}
+
+bool IsClosedBracket(OperatorOrFunctionCallToken* token)
+{
+	if (auto* op = dynamic_cast<Operator*>(token->value))
+		return op->operator_ == ")";
+	return false;
+}
+
+Operator* FindPrefixOperator(const std::string& opStr)
+{
+	for (auto* op : s_operators)
+	{
+		if (op->operator_ == opStr && dynamic_cast<SingleOperandOperator*>(op))
+			return op;
+	}
+	return nullptr;
+}
+
+std::vector<std::shared_ptr<Token>> ParseExpression(StringIterator& iterator, ScriptModule& scriptModule)
+{
+	std::vector<std::shared_ptr<Token>> result;
+	std::stack<std::shared_ptr<OperatorOrFunctionCallToken>> operatorsOrFuncs;
+	// an operator where an operand should be is a prefix operator, e.g. the '-' in 'x * -2'
+	auto expectOperand = true;
+	while (!iterator.End())
+	{
+		if (isspace(iterator.Peek()))
+		{
+			iterator.Advance();
+			continue;
+		}
+		if (auto operator_ = iterator.ParseOperator())
+		{
+			if (IsClosedBracket(operator_.get()))
+			{
+				while (!operatorsOrFuncs.empty() && !IsOpenBracket(operatorsOrFuncs.top().get()))
+				{
+					result.push_back(std::move(operatorsOrFuncs.top()));
+					operatorsOrFuncs.pop();
+				}
+				if (operatorsOrFuncs.empty())
+					throw ParseError("Mismatched brackets");
+				operatorsOrFuncs.pop();
+				expectOperand = false;
+			}
+			else if (auto* prefix = expectOperand ? FindPrefixOperator(operator_->Value()->operator_) : nullptr)
+			{
+				operatorsOrFuncs.push(std::make_shared<OperatorToken>(prefix));
+			}
+			else
+			{
+				expectOperand = true;
+				if (!IsOpenBracket(operator_.get()))
+				{
+					while (!operatorsOrFuncs.empty() && operatorsOrFuncs.top()->value->Precedes(operator_->value) && !IsOpenBracket(operatorsOrFuncs.top().get()))
+					{
+						result.push_back(std::move(operatorsOrFuncs.top()));
+						operatorsOrFuncs.pop();
+					}
+				}
+				operatorsOrFuncs.push(std::move(operator_));
+			}
+		}
+		else
+		{
+			if (iterator.Peek() == '"')
+			{
+				auto str = iterator.GetStringInQuotationMarks();
+				result.push_back(std::make_shared<StringConstantToken>(str));
+				expectOperand = false;
+			}
+			else
+			{
+				const auto opStr = iterator.GetCurOperandString();
+				if (!opStr.empty())
+				{
+					expectOperand = false;
+					if (auto operand = ParseNumericConstant(opStr))
+					{
+						result.push_back(std::move(operand));
+					}
+					else if (auto function = ParseFunctionCall(opStr))
+					{
+						function->Value()->ValidateCompilation(scriptModule);
+						// functions without parameters behave like operands, e.g. 'field readline "," 2'
+						if (function->Value()->numParams == 0)
+						{
+							result.push_back(std::move(function));
+						}
+						else
+						{
+							operatorsOrFuncs.push(std::move(function));
+							expectOperand = true;
+						}
+					}
+					else
+					{
+						result.push_back(std::make_shared<StringConstantToken>(opStr));
+					}
+				}
+			}
+		}
+	}
+	while (!operatorsOrFuncs.empty())
+	{
+		result.push_back(std::move(operatorsOrFuncs.top()));
+		operatorsOrFuncs.pop();
+	}
+	return result;
+}
+
+// Position of the first whole word 'keyword' outside of string literals, or npos
+std::size_t FindKeyword(std::string_view str, std::string_view keyword)
+{
+	auto inQuotes = false;
+	auto isWordChar = [](char ch) { return isalnum(static_cast<unsigned char>(ch)) || ch == '_'; };
+	for (auto pos = 0u; pos + keyword.size() <= str.size(); ++pos)
+	{
+		if (str[pos] == '"')
+			inQuotes = !inQuotes;
+		if (inQuotes || str.compare(pos, keyword.size(), keyword) != 0)
+			continue;
+		const auto end = pos + keyword.size();
+		if ((pos == 0 || !isWordChar(str[pos - 1])) && (end == str.size() || !isWordChar(str[end])))
+			return pos;
+	}
+	return std::string_view::npos;
+}
+
+// Removes 'keyword' from the front of str if it is the first word
+bool ConsumeKeyword(std::string_view& str, std::string_view keyword)
+{
+	const auto trimmed = Trim(str);
+	if (FindKeyword(trimmed, keyword) != 0)
+		return false;
+	str = trimmed.substr(keyword.size());
+	return true;
+}
+
+void AppendExpression(std::vector<std::shared_ptr<Token>>& tokens, std::string_view expression, ScriptModule& scriptModule, const char* what)
+{
+	if (Trim(expression).empty())
+		throw ParseError(std::string("Missing ") + what);
+	StringIterator iterator{std::string(expression)};
+	auto parsed = ParseExpression(iterator, scriptModule);
+	tokens.insert(tokens.end(), std::make_move_iterator(parsed.begin()), std::make_move_iterator(parsed.end()));
+}
+
+bool IsName(std::string_view str)
+{
+	return !str.empty() && std::all_of(str.begin(), str.end(), [](char ch) { return isalnum(static_cast<unsigned char>(ch)) || ch == '_'; });
+}
+
+// The header of 'for' and 'parallel for' after the keywords: '<name> = <first> to <last> [step <step>]', plus
+// '[reduce ...]' for parallel loops. Compiles to the line <name> <first> <last> <step> ["<reductions>"] <function>
+std::vector<std::shared_ptr<Token>> ParseForLoop(std::string_view header, const std::string& functionName, ScriptModule& scriptModule)
+{
+	const auto isParallel = functionName == "parallel for";
+	const auto assign = header.find('=');
+	const auto to = FindKeyword(header, "to");
+	if (assign == std::string_view::npos || to == std::string_view::npos || to < assign)
+		throw ParseError("Expected '" + functionName + " <variable> = <first> to <last>'");
+	const auto name = Trim(header.substr(0, assign));
+	if (!IsName(name))
+		throw ParseError("Invalid loop variable '" + std::string(name) + "'");
+
+	auto last = header.substr(to + 2);
+	std::string_view reductions;
+	if (const auto reduce = FindKeyword(last, "reduce"); reduce != std::string_view::npos)
+	{
+		if (!isParallel)
+			throw ParseError("'reduce' is only supported by 'parallel for'");
+		reductions = Trim(last.substr(reduce + 6));
+		last = last.substr(0, reduce);
+		ParallelForFunction::ParseReductions(reductions);
+	}
+	std::string_view step;
+	if (const auto stepPos = FindKeyword(last, "step"); stepPos != std::string_view::npos)
+	{
+		step = last.substr(stepPos + 4);
+		last = last.substr(0, stepPos);
+	}
+
+	std::vector<std::shared_ptr<Token>> tokens{std::make_shared<StringConstantToken>(StringValue(name))};
+	AppendExpression(tokens, header.substr(assign + 1, to - assign - 1), scriptModule, "first value of the loop");
+	AppendExpression(tokens, last, scriptModule, "last value of the loop");
+	if (step.data())
+		AppendExpression(tokens, step, scriptModule, "step of the loop");
+	else
+		tokens.push_back(std::make_shared<NumericConstantToken>(1));
+	if (isParallel)
+		tokens.push_back(std::make_shared<StringConstantToken>(StringValue(reductions)));
+	auto function = ParseFunctionCall(functionName);
+	function->Value()->ValidateCompilation(scriptModule);
+	tokens.push_back(std::move(function));
+	return tokens;
+}
+
+// 'generator <name> [<parameter> ...]'
+std::vector<std::shared_ptr<Token>> ParseGenerator(std::string_view header, ScriptModule& scriptModule)
+{
+	std::vector<std::string> words;
+	ForEachField(header, "", [&](std::string_view word)
+	{
+		words.emplace_back(word);
+		return true;
+	});
+	if (words.empty())
+		throw ParseError("Expected 'generator <name> [<parameter> ...]'");
+	for (auto& word : words)
+	{
+		if (!IsName(word))
+			throw ParseError("Invalid generator or parameter name '" + word + "'");
+	}
+	const auto name = words.front();
+	words.erase(words.begin());
+	auto generator = std::make_unique<GeneratorFunction>(name, std::move(words));
+	generator->ValidateCompilation(scriptModule);
+	auto loop = std::make_unique<GeneratorLoopFunction>(generator.get());
+	std::vector<std::shared_ptr<Token>> tokens{std::make_shared<FunctionCallToken>(generator.get())};
+	scriptModule.generatorLoops[name] = loop.get();
+	scriptModule.scriptFunctions.push_back(std::move(generator));
+	scriptModule.scriptFunctions.push_back(std::move(loop));
+	return tokens;
+}
+
+// 'for <name> in <generator> [<argument> ...]', compiled to <name> <arguments> 'for in'
+std::vector<std::shared_ptr<Token>> ParseGeneratorLoop(std::string_view name, std::string_view call, ScriptModule& scriptModule)
+{
+	if (!IsName(name))
+		throw ParseError("Invalid loop variable '" + std::string(name) + "'");
+	call = Trim(call);
+	const auto generatorName = call.substr(0, std::min(call.size(), call.find_first_of(" \t")));
+	const auto iter = scriptModule.generatorLoops.find(generatorName);
+	if (iter == scriptModule.generatorLoops.end())
+		throw ParseError("Unknown generator '" + std::string(generatorName) + "'");
+	auto* function = iter->second;
+
+	std::vector<std::shared_ptr<Token>> tokens{std::make_shared<StringConstantToken>(StringValue(name))};
+	StringIterator iterator{std::string(call.substr(generatorName.size()))};
+	auto arguments = ParseExpression(iterator, scriptModule);
+	// the arguments are consecutive expressions; count the values they leave behind
+	auto numValues = 0;
+	for (auto& token : arguments)
+	{
+		if (dynamic_cast<OperandToken*>(token.get()))
+			++numValues;
+		else if (auto* call = dynamic_cast<FunctionCallToken*>(token.get()))
+			numValues += 1 - static_cast<int>(call->Value()->numParams);
+		else if (auto* op = dynamic_cast<OperatorToken*>(token.get()); op && dynamic_cast<DualOperandOperator*>(op->Value()))
+			--numValues;
+	}
+	if (numValues != static_cast<int>(function->numParams) - 1)
+		throw ParseError("Generator '" + std::string(generatorName) + "' takes " + std::to_string(function->numParams - 1) + " argument(s)");
+	tokens.insert(tokens.end(), std::make_move_iterator(arguments.begin()), std::make_move_iterator(arguments.end()));
+	function->ValidateCompilation(scriptModule);
+	tokens.push_back(std::make_shared<FunctionCallToken>(function));
+	return tokens;
+}
+
+// Compiles one script line; statements with their own syntax are recognized by their leading keywords
+// A line suspended on an async call is evaluated again when resumed, so nothing before the call may have effects
+void ValidateAsyncCalls(const std::vector<std::shared_ptr<Token>>& tokens)
+{
+	const auto isAsync = [](Token* token)
+	{
+		auto* call = dynamic_cast<FunctionCallToken*>(token);
+		return call && dynamic_cast<AsyncFunction*>(call->Value());
+	};
+	const auto asyncCall = std::find_if(tokens.begin(), tokens.end(), [&](const auto& token) { return isAsync(token.get()); });
+	if (asyncCall == tokens.end())
+		return;
+	if (std::any_of(asyncCall + 1, tokens.end(), [&](const auto& token) { return isAsync(token.get()); }))
+		throw ParseError("Only one async call is allowed per line");
+	// the line runs again from its start when the script resumes, so nothing before the call may have side effects
+	const auto& asyncName = static_cast<FunctionCallToken*>(asyncCall->get())->Value()->name;
+	for (auto iter = tokens.begin(); iter != asyncCall; ++iter)
+	{
+		auto* call = dynamic_cast<FunctionCallToken*>(iter->get());
+		if (call && !call->Value()->IsPure())
+			throw ParseError("'" + call->Value()->name + "' can't be called before async function '" + asyncName + "'");
+		auto* op = dynamic_cast<OperatorToken*>(iter->get());
+		if (op && op->Value()->operator_ == "=")
+			throw ParseError("Variables can't be assigned before async function '" + asyncName + "' on the same line");
+	}
+}
+
+std::vector<std::shared_ptr<Token>> ParseStatement(const std::string& line, ScriptModule& scriptModule)
+{
+	std::string_view rest = line;
+	if (ConsumeKeyword(rest, "for"))
+	{
+		// 'for <name> in ...' or 'for <name> = ...'
+		rest = Trim(rest);
+		const auto nameEnd = std::min(rest.size(), rest.find_first_of(" \t="));
+		auto call = rest.substr(nameEnd);
+		if (ConsumeKeyword(call, "in"))
+			return ParseGeneratorLoop(rest.substr(0, nameEnd), call, scriptModule);
+		return ParseForLoop(rest, "for", scriptModule);
+	}
+	rest = line;
+	if (ConsumeKeyword(rest, "generator"))
+		return ParseGenerator(rest, scriptModule);
+	rest = line;
+	if (ConsumeKeyword(rest, "parallel") && ConsumeKeyword(rest, "for"))
+		return ParseForLoop(rest, "parallel for", scriptModule);
+	StringIterator iterator(line);
+	auto tokens = ParseExpression(iterator, scriptModule);
+	ValidateAsyncCalls(tokens);
+	return tokens;
+}
+
+// The result may be borrowed from the line or a variable (see Borrow), so it is used before anything else runs
+std::shared_ptr<OperandToken> EvaluateExpression(TokenRange tokens, ScriptModule& scriptModule)
+{
+	EvaluationFrame stack;
+	for (auto& token : tokens)
+	{
+		if (auto* operand = dynamic_cast<OperandToken*>(token.get()))
+		{
+			OperandToken* varToken;
+			if (auto* strToken = dynamic_cast<StringConstantToken*>(operand); strToken && ((varToken = ParseVariableToken(strToken->View()))))
+			{
+				// variable
+				stack.Push(Borrow(varToken));
+			}
+			else
+			{
+				stack.Push(Borrow(operand));
+			}
+		}
+		else if (auto* operator_ = dynamic_cast<OperatorToken*>(token.get()))
+		{
+			std::shared_ptr<OperandToken> result;
+			if (stack.Size() < operator_->Value()->numOperands)
+				throw ParseError("Invalid number of operands for operator " + std::to_string(operator_->Value()->numOperands));
+			if (auto* op = dynamic_cast<DualOperandOperator*>(operator_->Value()))
+			{
+				auto rhsToken = stack.Pop();
+				auto lhsToken = stack.Pop();
+				result = op->Eval(lhsToken.get(), rhsToken.get());
+			}
+			else if (auto* op = dynamic_cast<SingleOperandOperator*>(operator_->Value()))
+			{
+				auto token = stack.Pop();
+				result = op->Eval(token.get());
+			}
+			if (!result)
+				throw ParseError("Invalid operands for operator " + operator_->Value()->operator_);
+			stack.Push(std::move(result));
+		}
+		else if (auto* function = dynamic_cast<FunctionCallToken*>(token.get()))
+		{
+			if (stack.Size() < function->Value()->numParams)
+				throw ParseError("Invalid number of arguments for function " + function->ToString());
+			auto& params = stack.PopParams(function->Value()->numParams);
+			if (!function->Value()->ValidateParams(params))
+				throw ParseError("Wrong parameter types for function " + function->ToString());
+			TraceScope trace;
+			if (TRACE_ENABLED())
+				trace.Begin(TraceKind::Call, function->Value()->name, TraceLine());
+			auto result = function->Value()->Call(params, scriptModule);
+			stack.ReleaseParams();
+			stack.Push(std::move(result));
+		}
+	}
+	if (stack.Size() != 1)
+	{
+		throw ParseError("Not a valid expression");
+	}
+	
+	return stack.Pop();
+}
+
+bool OperatorOrFunction::Precedes(OperatorOrFunction* other) const
+{
+	if (auto* op = dynamic_cast<Operator*>(other))
+	{
+		if (op->numOperands == 1)
+			return other->precedence < precedence;
+	}
+	return other->precedence <= precedence;
+}
+
+// Compile-time simplification of a whole script: folds constant sub-expressions, substitutes variables that are
+// assigned a constant exactly once, drops if/elseif/while branches whose conditions are constant and removes
+// assignments whose values are never read. Variables are only known by name, so every string operand counts as
+// a possible read; scripts that create variables under computed names are only constant folded.
+class ScriptOptimizer
+{
+public:
+	static constexpr int MAX_PASSES = 8;
+
+	explicit ScriptOptimizer(ScriptModule& scriptModule)
+		: scriptModule(scriptModule)
+	{
+	}
+
+	void Run()
+	{
+		for (auto pass = 0; pass < MAX_PASSES; ++pass)
+		{
+			Analyze();
+			auto changed = false;
+			for (auto& line : scriptModule.compiled->scriptRunLines)
+				changed |= FoldConstants(line.tokens);
+			changed |= PropagateConstants();
+			changed |= SimplifyBranches();
+			Analyze();
+			changed |= RemoveDeadStores();
+			if (!changed)
+				break;
+		}
+		Analyze();
+		EliminateCommonSubexpressions();
+	}
+
+private:
+	ScriptModule& scriptModule;
+	// constants are evaluated on this empty module, so that names never resolve to the variables of whichever
+	// module happens to be active on the compiling thread
+	ScriptModule constantScope;
+	std::set<std::string, std::less<>> assignedNames;
+	bool dynamicNames = false;
+	int numTemporaries = 0;
+
+	using Tokens = std::vector<std::shared_ptr<Token>>;
+
+	static int GetArity(Token* token)
+	{
+		if (dynamic_cast<OperandToken*>(token))
+			return 0;
+		if (auto* function = dynamic_cast<FunctionCallToken*>(token))
+			return static_cast<int>(function->Value()->numParams);
+		if (auto* op = dynamic_cast<OperatorToken*>(token))
+		{
+			if (dynamic_cast<DualOperandOperator*>(op->Value()))
+				return 2;
+			if (dynamic_cast<SingleOperandOperator*>(op->Value()))
+				return 1;
+		}
+		return -1;
+	}
+
+	// For every token, the index of the first token of the sub-expression that ends with it. Fails for lines
+	// that wouldn't evaluate cleanly (e.g. unmatched brackets), which are then left alone.
+	static bool GetStarts(const Tokens& tokens, std::vector<std::size_t>& starts)
+	{
+		starts.assign(tokens.size(), 0);
+		std::vector<std::size_t> ends;
+		for (auto i = 0u; i < tokens.size(); ++i)
+		{
+			const auto arity = GetArity(tokens[i].get());
+			if (arity < 0 || ends.size() < static_cast<std::size_t>(arity))
+				return false;
+			starts[i] = i;
+			for (auto k = 0; k < arity; ++k)
+			{
+				starts[i] = starts[ends.back()];
+				ends.pop_back();
+			}
+			ends.push_back(i);
+		}
+		return ends.size() == 1;
+	}
+
+	static bool IsAssignment(Token* token)
+	{
+		auto* op = dynamic_cast<OperatorToken*>(token);
+		return op && op->Value()->operator_ == "=";
+	}
+
+	static Function* GetFunction(Token* token)
+	{
+		auto* function = dynamic_cast<FunctionCallToken*>(token);
+		return function ? function->Value() : nullptr;
+	}
+
+	// The function that decides how a line takes part in a block (if / elseif / else / while / end), if any
+	template <typename T>
+	T* GetLineFunction(std::size_t line)
+	{
+		auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+		if (tokens.empty())
+			return nullptr;
+		return dynamic_cast<T*>(GetFunction(tokens.back().get()));
+	}
+
+	// The left operand of the assignment ending at index i, if it is a plain name
+	static StringConstantToken* GetAssignedName(const Tokens& tokens, const std::vector<std::size_t>& starts, std::size_t i)
+	{
+		const auto lhsEnd = starts[i - 1] - 1;
+		if (starts[lhsEnd] != lhsEnd)
+			return nullptr;
+		return dynamic_cast<StringConstantToken*>(tokens[lhsEnd].get());
+	}
+
+	static bool DefinesVariable(Token* token)
+	{
+		auto* function = GetFunction(token);
+		return IsAssignment(token) || (function && function->DefinesVariable());
+	}
+
+	// The name token assigned by the token at index i: the left operand of '=' or the first parameter of calls like
+	// 'for'. Null if it doesn't assign, or assigns to a computed name.
+	static StringConstantToken* GetDefinedName(const Tokens& tokens, const std::vector<std::size_t>& starts, std::size_t i, std::size_t& nameIndex)
+	{
+		if (IsAssignment(tokens[i].get()))
+			nameIndex = starts[i - 1] - 1;
+		else if (DefinesVariable(tokens[i].get()))
+			nameIndex = starts[i];
+		else
+			return nullptr;
+		if (starts[nameIndex] != nameIndex)
+			return nullptr;
+		return dynamic_cast<StringConstantToken*>(tokens[nameIndex].get());
+	}
+
+	bool MayBeVariable(std::string_view name) const
+	{
+		return dynamicNames || assignedNames.find(name) != assignedNames.end();
+	}
+
+	bool IsConstant(Token* token) const
+	{
+		if (dynamic_cast<NumericConstantToken*>(token))
+			return true;
+		auto* str = dynamic_cast<StringConstantToken*>(token);
+		return str && !MayBeVariable(str->value.View());
+	}
+
+	void Analyze()
+	{
+		assignedNames.clear();
+		dynamicNames = false;
+		std::vector<std::size_t> starts;
+		for (auto& line : scriptModule.compiled->scriptRunLines)
+		{
+			auto& tokens = line.tokens;
+			const auto valid = GetStarts(tokens, starts);
+			for (auto i = 0u; i < tokens.size(); ++i)
+			{
+				if (auto* function = GetFunction(tokens[i].get()); function && function->HasHiddenVariableAccess())
+					dynamicNames = true;
+				if (!DefinesVariable(tokens[i].get()))
+					continue;
+				std::size_t nameIndex;
+				auto* name = valid ? GetDefinedName(tokens, starts, i, nameIndex) : nullptr;
+				if (name)
+					assignedNames.emplace(name->value.View());
+				else
+					dynamicNames = true;
+			}
+		}
+	}
+
+	bool FoldConstants(Tokens& tokens)
+	{
+		auto changed = false;
+		std::vector<std::size_t> starts;
+		for (auto i = 0u; i < tokens.size(); ++i)
+		{
+			const auto arity = GetArity(tokens[i].get());
+			if (arity <= 0 && !GetFunction(tokens[i].get()))
+				continue;
+			if (!GetStarts(tokens, starts))
+				return changed;
+			if (IsAssignment(tokens[i].get()))
+				continue;
+			if (auto* function = GetFunction(tokens[i].get()); function && !function->IsPure())
+				continue;
+			const auto start = starts[i];
+			if (i - start != static_cast<std::size_t>(arity))
+				continue;
+			auto allConstant = true;
+			for (auto k = start; k < i; ++k)
+				allConstant = allConstant && IsConstant(tokens[k].get());
+			if (!allConstant)
+				continue;
+
+			std::shared_ptr<Token> folded;
+			try
+			{
+				Tokens expression(tokens.begin() + start, tokens.begin() + i + 1);
+				ActiveModuleScope scope(constantScope);
+				auto result = EvaluateExpression(expression, constantScope);
+				if (auto* num = dynamic_cast<NumericToken*>(result.get()))
+					folded = std::make_shared<NumericConstantToken>(num->Value());
+				else if (auto* str = dynamic_cast<StringToken*>(result.get()); str && !MayBeVariable(str->View()))
+					folded = std::make_shared<StringConstantToken>(StringValue(str->View()));
+			}
+			catch (const ParseError&)
+			{
+				// left for the runtime to report
+			}
+			if (!folded)
+				continue;
+			tokens.erase(tokens.begin() + start, tokens.begin() + i + 1);
+			tokens.insert(tokens.begin() + start, std::move(folded));
+			i = start;
+			changed = true;
+		}
+		return changed;
+	}
+
+	// Nesting depth of every line; block headers, else/elseif and end count as the outer level
+	std::vector<int> GetDepths()
+	{
+		std::vector<int> depths;
+		auto depth = 0;
+		for (auto i = 0u; i < scriptModule.compiled->scriptRunLines.size(); ++i)
+		{
+			if (GetLineFunction<EndFunction>(i))
+				--depth;
+			auto lineDepth = depth;
+			if (GetLineFunction<ElseFunction>(i) || GetLineFunction<ElseIfFunction>(i))
+				lineDepth = depth - 1;
+			if (GetLineFunction<NestedFunction>(i))
+				++depth;
+			depths.push_back(lineDepth);
+		}
+		return depths;
+	}
+
+	// A variable assigned exactly once, at the top level, from a constant always holds that constant afterwards
+	bool PropagateConstants()
+	{
+		if (dynamicNames)
+			return false;
+		struct Definition
+		{
+			int count = 0;
+			std::size_t line = 0;
+			std::shared_ptr<Token> value;
+			std::size_t firstUse = SIZE_MAX;
+		};
+		std::map<std::string, Definition, std::less<>> definitions;
+		const auto depths = GetDepths();
+		std::vector<std::size_t> starts;
+		std::vector<std::vector<bool>> isName(scriptModule.compiled->scriptRunLines.size());
+		for (auto line = 0u; line < scriptModule.compiled->scriptRunLines.size(); ++line)
+		{
+			auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+			if (!GetStarts(tokens, starts))
+				return false;
+			isName[line].assign(tokens.size(), false);
+			for (auto i = 0u; i < tokens.size(); ++i)
+			{
+				std::size_t nameIndex;
+				auto* name = GetDefinedName(tokens, starts, i, nameIndex);
+				if (!name)
+					continue;
+				isName[line][nameIndex] = true;
+				auto& definition = definitions[std::string(name->value.View())];
+				++definition.count;
+				definition.line = line;
+				definition.value = nullptr;
+				const auto isStatement = IsAssignment(tokens[i].get()) && i == tokens.size() - 1 && tokens.size() == 3 && depths[line] == 0;
+				if (isStatement && IsConstant(tokens[1].get()))
+					definition.value = tokens[1];
+			}
+		}
+		for (auto line = 0u; line < scriptModule.compiled->scriptRunLines.size(); ++line)
+		{
+			auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+			for (auto i = 0u; i < tokens.size(); ++i)
+			{
+				auto* str = dynamic_cast<StringConstantToken*>(tokens[i].get());
+				if (!str || isName[line][i])
+					continue;
+				if (const auto iter = definitions.find(str->value.View()); iter != definitions.end())
+					iter->second.firstUse = std::min<std::size_t>(iter->second.firstUse, line);
+			}
+		}
+
+		auto changed = false;
+		for (auto line = 0u; line < scriptModule.compiled->scriptRunLines.size(); ++line)
+		{
+			auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+			for (auto i = 0u; i < tokens.size(); ++i)
+			{
+				auto* str = dynamic_cast<StringConstantToken*>(tokens[i].get());
+				if (!str || isName[line][i])
+					continue;
+				const auto iter = definitions.find(str->value.View());
+				if (iter == definitions.end())
+					continue;
+				auto& definition = iter->second;
+				if (definition.count == 1 && definition.value && definition.firstUse > definition.line)
+				{
+					tokens[i] = definition.value;
+					changed = true;
+				}
+			}
+		}
+		return changed;
+	}
+
+	// 1 or 0 for a header whose condition folded to a number, -1 otherwise
+	int GetConstantCondition(std::size_t line)
+	{
+		auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+		if (tokens.size() != 2)
+			return -1;
+		auto* num = dynamic_cast<NumericConstantToken*>(tokens[0].get());
+		if (!num)
+			return -1;
+		return num->value != 0;
+	}
+
+	bool SimplifyBranches()
+	{
+		const auto numLines = scriptModule.compiled->scriptRunLines.size();
+		std::vector<bool> removed(numLines, false);
+		std::map<std::size_t, Tokens> rewrites;
+		auto changed = false;
+		auto removeRange = [&](std::size_t from, std::size_t to)
+		{
+			for (auto i = from; i < to; ++i)
+				removed[i] = true;
+			changed = true;
+		};
+
+		for (auto line = 0u; line < numLines; ++line)
+		{
+			if (GetLineFunction<WhileFunction>(line))
+			{
+				if (GetConstantCondition(line) == 0)
+					removeRange(line, scriptModule.compiled->beginToEndMap[static_cast<int>(line)] + 1);
+				continue;
+			}
+			if (!GetLineFunction<IfFunction>(line))
+				continue;
+
+			// headers of the if / elseif / else clauses of this block, then the end line
+			std::vector<std::size_t> headers{line};
+			while (!GetLineFunction<EndFunction>(headers.back()))
+				headers.push_back(scriptModule.compiled->beginToEndMap[static_cast<int>(headers.back())]);
+			const auto endLine = headers.back();
+			headers.pop_back();
+
+			std::vector<std::size_t> kept;
+			auto alwaysTaken = false;
+			for (auto c = 0u; c < headers.size(); ++c)
+			{
+				const auto clauseEnd = c + 1 < headers.size() ? headers[c + 1] : endLine;
+				if (alwaysTaken)
+				{
+					removeRange(headers[c], clauseEnd);
+					continue;
+				}
+				const auto condition = GetLineFunction<ElseFunction>(headers[c]) ? 1 : GetConstantCondition(headers[c]);
+				if (condition == 0)
+				{
+					removeRange(headers[c], clauseEnd);
+					continue;
+				}
+				kept.push_back(headers[c]);
+				alwaysTaken = condition == 1;
+			}
+
+			if (kept.empty())
+			{
+				removeRange(endLine, endLine + 1);
+			}
+			else if (alwaysTaken && kept.size() == 1)
+			{
+				// the only clause left always runs, so its body replaces the whole block
+				removeRange(kept.front(), kept.front() + 1);
+				removeRange(endLine, endLine + 1);
+			}
+			else
+			{
+				if (GetLineFunction<ElseIfFunction>(kept.front()))
+				{
+					auto tokens = scriptModule.compiled->scriptRunLines[kept.front()].tokens;
+					tokens.back() = ParseFunctionCall("if");
+					rewrites[kept.front()] = std::move(tokens);
+					changed = true;
+				}
+				if (alwaysTaken && GetLineFunction<ElseIfFunction>(kept.back()))
+				{
+					rewrites[kept.back()] = Tokens{ParseFunctionCall("else")};
+					changed = true;
+				}
+			}
+		}
+		if (!changed)
+			return false;
+		for (auto& [line, tokens] : rewrites)
+		{
+			if (!removed[line])
+				scriptModule.compiled->scriptRunLines[line].tokens = std::move(tokens);
+		}
+		scriptModule.RemoveRunLines(removed);
+		return true;
+	}
+
+	std::vector<std::size_t> GetSuccessors(std::size_t line)
+	{
+		std::vector<std::size_t> successors{line + 1};
+		const auto key = static_cast<int>(line);
+		if (GetLineFunction<NestedFunction>(line) || GetLineFunction<ElseIfFunction>(line) || GetLineFunction<ElseFunction>(line))
+		{
+			successors.push_back(scriptModule.compiled->beginToEndMap[key]);
+		}
+		else if (auto* loopExit = GetLineFunction<LoopExitFunction>(line))
+		{
+			const auto endLine = static_cast<std::size_t>(scriptModule.compiled->loopExitMap[key].endLine);
+			successors = {loopExit->name == "break" ? endLine + 1 : endLine};
+		}
+		else if (GetLineFunction<EndFunction>(line))
+		{
+			const auto header = static_cast<std::size_t>(scriptModule.compiled->endToBeginMap[key].lineNumber);
+			if (GetLineFunction<WhileFunction>(header) || GetLineFunction<ForFunction>(header) || GetLineFunction<GeneratorLoopFunction>(header))
+				successors.push_back(header);
+		}
+		return successors;
+	}
+
+	// Backwards liveness over the line graph; a plain 'name = value' line is dropped if the name is dead after it.
+	// Every variable is live when the script ends, as hosts read the results of a module after running it.
+	bool RemoveDeadStores()
+	{
+		if (dynamicNames)
+			return false;
+		const auto numLines = scriptModule.compiled->scriptRunLines.size();
+		std::map<std::string_view, std::size_t> nameIds;
+		auto getId = [&](std::string_view name)
+		{
+			return nameIds.emplace(name, nameIds.size()).first->second;
+		};
+
+		std::vector<std::vector<std::size_t>> uses(numLines);
+		std::vector<std::size_t> defs(numLines, SIZE_MAX);
+		std::vector<bool> removable(numLines, false);
+		std::vector<std::size_t> starts;
+		for (auto line = 0u; line < numLines; ++line)
+		{
+			auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+			if (!GetStarts(tokens, starts))
+				return false;
+			std::vector<bool> isName(tokens.size(), false);
+			for (auto i = 0u; i < tokens.size(); ++i)
+			{
+				std::size_t nameIndex;
+				if (auto* name = GetDefinedName(tokens, starts, i, nameIndex))
+				{
+					isName[nameIndex] = true;
+					defs[line] = getId(name->value.View());
+				}
+			}
+			// the 'end' of a 'for' loop steps its variable
+			if (GetLineFunction<EndFunction>(line))
+			{
+				const auto header = static_cast<std::size_t>(scriptModule.compiled->endToBeginMap[static_cast<int>(line)].lineNumber);
+				if (GetLineFunction<ForFunction>(header))
+					uses[line].push_back(getId(dynamic_cast<StringConstantToken*>(scriptModule.compiled->scriptRunLines[header].tokens.front().get())->value.View()));
+			}
+			for (auto i = 0u; i < tokens.size(); ++i)
+			{
+				if (auto* str = dynamic_cast<StringConstantToken*>(tokens[i].get()); str && !isName[i])
+					uses[line].push_back(getId(str->value.View()));
+			}
+			removable[line] = tokens.size() == 3 && IsAssignment(tokens[2].get()) && dynamic_cast<OperandToken*>(tokens[1].get());
+		}
+
+		const auto numNames = nameIds.size();
+		std::vector<std::vector<bool>> liveIn(numLines + 1, std::vector<bool>(numNames, false));
+		liveIn[numLines].assign(numNames, true);
+		std::vector<std::vector<bool>> liveOut(numLines, std::vector<bool>(numNames, false));
+		std::vector<std::vector<std::size_t>> successors(numLines);
+		for (auto line = 0u; line < numLines; ++line)
+			successors[line] = GetSuccessors(line);
+		for (auto changed = true; changed;)
+		{
+			changed = false;
+			for (auto line = numLines; line-- > 0;)
+			{
+				auto out = std::vector<bool>(numNames, false);
+				for (const auto successor : successors[line])
+				{
+					for (auto n = 0u; n < numNames; ++n)
+						out[n] = out[n] || liveIn[successor][n];
+				}
+				auto in = out;
+				if (defs[line] != SIZE_MAX)
+					in[defs[line]] = false;
+				for (const auto use : uses[line])
+					in[use] = true;
+				if (in != liveIn[line] || out != liveOut[line])
+				{
+					liveIn[line] = std::move(in);
+					liveOut[line] = std::move(out);
+					changed = true;
+				}
+			}
+		}
+
+		std::vector<bool> removed(numLines, false);
+		auto anyRemoved = false;
+		for (auto line = 0u; line < numLines; ++line)
+		{
+			if (removable[line] && !liveOut[line][defs[line]])
+				removed[line] = anyRemoved = true;
+		}
+		if (anyRemoved)
+			scriptModule.RemoveRunLines(removed);
+		return anyRemoved;
+	}
+
+	static Operator* GetAssignmentOperator()
+	{
+		for (auto* op : s_operators)
+		{
+			if (op->operator_ == "=")
+				return op;
+		}
+		return nullptr;
+	}
+
+	// Token text used to recognize equal sub-expressions; empty for tokens that can't be shared (calls with side
+	// effects, assignments)
+	static std::string GetTokenKey(Token* token)
+	{
+		if (auto* num = dynamic_cast<NumericConstantToken*>(token))
+			return "n" + std::string(reinterpret_cast<const char*>(&num->value), sizeof(num->value));
+		if (auto* str = dynamic_cast<StringConstantToken*>(token))
+			return "s" + std::string(str->value.View());
+		if (IsAssignment(token))
+			return {};
+		auto* call = dynamic_cast<OperatorOrFunctionCallToken*>(token);
+		if (!call)
+			return {};
+		if (auto* function = GetFunction(token); function && !function->IsPure())
+			return {};
+		return "o" + std::string(reinterpret_cast<const char*>(&call->value), sizeof(call->value));
+	}
+
+	static bool IsBlockLine(const Tokens& tokens)
+	{
+		auto* function = tokens.empty() ? nullptr : GetFunction(tokens.back().get());
+		return dynamic_cast<NestedFunction*>(function) || dynamic_cast<ElseFunction*>(function)
+			|| dynamic_cast<ElseIfFunction*>(function) || dynamic_cast<EndFunction*>(function);
+	}
+
+	// Expressions computed more than once within a run of lines without blocks and without assignments to the
+	// variables they read are computed once into a temporary variable, e.g.
+	//   a = x * y + z        $cse0 = x * y + z
+	//   b = (x * y + z) / 2  a = $cse0
+	//                        b = $cse0 / 2
+	// Only expressions of at least two operations are worth the extra line.
+	bool EliminateCommonSubexpressions()
+	{
+		if (dynamicNames)
+			return false;
+		struct Occurrence
+		{
+			std::size_t line;
+			std::size_t start;
+			std::size_t end;
+		};
+		struct Expression
+		{
+			std::vector<Occurrence> occurrences;
+			std::vector<std::string> names;
+			std::size_t size = 0;
+		};
+		auto changed = false;
+		for (auto found = true; found;)
+		{
+			found = false;
+			std::map<std::string, Expression> available;
+			Expression best;
+			auto retire = [&](const std::function<bool(const Expression&)>& isKilled)
+			{
+				for (auto iter = available.begin(); iter != available.end();)
+				{
+					if (!isKilled(iter->second))
+					{
+						++iter;
+						continue;
+					}
+					if (iter->second.occurrences.size() > 1 && iter->second.size > best.size)
+						best = std::move(iter->second);
+					iter = available.erase(iter);
+				}
+			};
+			auto retireAll = [&] { retire([](const Expression&) { return true; }); };
+
+			std::vector<std::size_t> starts;
+			for (auto line = 0u; line < scriptModule.compiled->scriptRunLines.size(); ++line)
+			{
+				auto& tokens = scriptModule.compiled->scriptRunLines[line].tokens;
+				if (IsBlockLine(tokens) || !GetStarts(tokens, starts))
+				{
+					retireAll();
+					continue;
+				}
+				std::vector<std::string> keys(tokens.size());
+				std::vector<std::string> assigned;
+				for (auto i = 0u; i < tokens.size(); ++i)
+				{
+					if (IsAssignment(tokens[i].get()))
+					{
+						assigned.emplace_back(GetAssignedName(tokens, starts, i)->value.View());
+						continue;
+					}
+					auto key = GetTokenKey(tokens[i].get());
+					// a sub-expression is shareable if all of its children are; children are found right to left
+					for (auto child = i; !key.empty() && child > starts[i];)
+					{
+						--child;
+						if (keys[child].empty())
+							key.clear();
+						else
+							key += '\0' + keys[child];
+						child = starts[child];
+					}
+					keys[i] = std::move(key);
+				}
+				// assignments inside an expression change variables halfway through the line
+				const auto nestedAssignment = !tokens.empty() && !assigned.empty()
+					&& (assigned.size() > 1 || !IsAssignment(tokens.back().get()));
+				for (auto i = 0u; i < tokens.size() && !nestedAssignment; ++i)
+				{
+					auto operations = 0u;
+					for (auto k = starts[i]; k <= i; ++k)
+						operations += !dynamic_cast<OperandToken*>(tokens[k].get());
+					if (keys[i].empty() || operations < 2)
+						continue;
+					auto& expression = available[keys[i]];
+					if (expression.occurrences.empty())
+					{
+						expression.size = i - starts[i] + 1;
+						for (auto k = starts[i]; k <= i; ++k)
+						{
+							if (auto* str = dynamic_cast<StringConstantToken*>(tokens[k].get()))
+								expression.names.emplace_back(str->value.View());
+						}
+					}
+					expression.occurrences.push_back({line, starts[i], i});
+				}
+				retire([&](const Expression& expression)
+				{
+					for (const auto& name : assigned)
+					{
+						if (std::find(expression.names.begin(), expression.names.end(), name) != expression.names.end())
+							return true;
+					}
+					return false;
+				});
+			}
+			retireAll();
+			if (best.occurrences.empty())
+				break;
+
+			const auto name = "$cse" + std::to_string(numTemporaries++);
+			const auto& first = best.occurrences.front();
+			auto& firstTokens = scriptModule.compiled->scriptRunLines[first.line].tokens;
+			Tokens definition{std::make_shared<StringConstantToken>(StringValue(name))};
+			definition.insert(definition.end(), firstTokens.begin() + first.start, firstTokens.begin() + first.end + 1);
+			definition.push_back(std::make_shared<OperatorToken>(GetAssignmentOperator()));
+			for (auto iter = best.occurrences.rbegin(); iter != best.occurrences.rend(); ++iter)
+			{
+				auto& tokens = scriptModule.compiled->scriptRunLines[iter->line].tokens;
+				tokens.erase(tokens.begin() + iter->start, tokens.begin() + iter->end + 1);
+				tokens.insert(tokens.begin() + iter->start, std::make_shared<StringConstantToken>(StringValue(name)));
+			}
+			scriptModule.compiled->scriptRunLines.insert(scriptModule.compiled->scriptRunLines.begin() + first.line, ScriptLine(std::move(definition)));
+			scriptModule.compiled->lineTable.Insert(first.line, scriptModule.compiled->lineTable.Find(first.line));
+			scriptModule.RelinkBlocks();
+			found = changed = true;
+		}
+		return changed;
+	}
+};
+
+void ScriptModule::Optimize()
+{
+	// folding constants evaluates expressions, which would show up in traces as calls the script never made
+	TraceSuspension noTracing;
+	ScriptOptimizer(*this).Run();
+	// snapshots refer to run lines, which differ between optimized and plain compiles of the same source
+	sourceHash = HashString("optimized", sourceHash);
+}
+
+// The tokens of a finalized module, copied side by side into one block in the order the lines run them. The
+// copies are handed out as shared_ptrs that share ownership of the whole arena.
+class TokenArena : public std::enable_shared_from_this<TokenArena>
+{
+public:
+	explicit TokenArena(std::size_t capacity)
+		: storage(new unsigned char[capacity]), capacity(capacity)
+	{
+	}
+
+	~TokenArena()
+	{
+		for (auto iter = tokens.rbegin(); iter != tokens.rend(); ++iter)
+			(*iter)->~Token();
+	}
+
+	TokenArena(const TokenArena&) = delete;
+	TokenArena& operator=(const TokenArena&) = delete;
+
+	// Adds the room the token takes up in the arena to the given size; tokens that stay where they are take none
+	static void Reserve(Token* token, std::size_t& size)
+	{
+		Visit(token, [&](auto* typed)
+		{
+			using T = std::remove_pointer_t<decltype(typed)>;
+			size = (size + alignof(T) - 1) / alignof(T) * alignof(T) + sizeof(T);
+		});
+	}
+
+	// A copy of the token in the arena, or the token itself if it's of a kind that isn't packed
+	std::shared_ptr<Token> Pack(std::shared_ptr<Token> token)
+	{
+		Visit(token.get(), [&](auto* typed)
+		{
+			using T = std::remove_pointer_t<decltype(typed)>;
+			auto space = capacity - used;
+			void* at = storage.get() + used;
+			if (!std::align(alignof(T), sizeof(T), at, space))
+				return;
+			auto* copy = new (at) T(*typed);
+			used = capacity - space + sizeof(T);
+			tokens.push_back(copy);
+			token = std::shared_ptr<Token>(shared_from_this(), copy);
+		});
+		return token;
+	}
+
+private:
+	std::unique_ptr<unsigned char[]> storage;
+	std::size_t capacity;
+	std::size_t used = 0;
+	std::vector<Token*> tokens;
+
+	// the kinds of tokens compiling produces; they hold no state that changes while the script runs
+	template <typename F>
+	static void Visit(Token* token, F&& visitor)
+	{
+		if (auto* num = dynamic_cast<NumericConstantToken*>(token))
+			visitor(num);
+		else if (auto* str = dynamic_cast<StringConstantToken*>(token))
+			visitor(str);
+		else if (auto* function = dynamic_cast<FunctionCallToken*>(token))
+			visitor(function);
+		else if (auto* op = dynamic_cast<OperatorToken*>(token))
+			visitor(op);
+	}
+};
+
+// Drops what is only needed for compiling and packs the tokens of all lines into one array of pointers to
+// tokens that are stored side by side in a TokenArena. The module can still run, take snapshots and create
+// frames, but no longer be compiled onto or optimized.
+void ScriptModule::Finalize()
+{
+	std::size_t numTokens = 0;
+	std::size_t arenaSize = 0;
+	for (const auto& line : compiled->scriptRunLines)
+	{
+		numTokens += line.tokens.size();
+		for (const auto& token : line.tokens)
+			TokenArena::Reserve(token.get(), arenaSize);
+	}
+	const auto arena = std::make_shared<TokenArena>(arenaSize);
+	// the lines point into the array, so it's sized once and never grows
+	compiled->code.clear();
+	compiled->code.reserve(numTokens);
+	for (auto& line : compiled->scriptRunLines)
+	{
+		auto* first = compiled->code.data() + compiled->code.size();
+		for (auto& token : line.tokens)
+			compiled->code.push_back(arena->Pack(std::move(token)));
+		line.code = TokenRange(first, compiled->code.data() + compiled->code.size());
+		line.tokens = {};
+	}
+	compiled->scriptRunLines.shrink_to_fit();
+	scriptCompileLines = {};
+	nestStack = {};
+	generatorLoops = {};
+}
+
+void ScriptModule::RemoveRunLines(const std::vector<bool>& removed)
+{
+	std::size_t kept = 0;
+	for (auto i = 0u; i < compiled->scriptRunLines.size(); ++i)
+	{
+		if (removed[i])
+			continue;
+		if (kept != i)
+			compiled->scriptRunLines[kept] = std::move(compiled->scriptRunLines[i]);
+		++kept;
+	}
+	compiled->scriptRunLines.erase(compiled->scriptRunLines.begin() + kept, compiled->scriptRunLines.end());
+	compiled->lineTable.Remove(removed);
+	RelinkBlocks();
+}
+
+// Rebuilds the block maps from the compiled lines, e.g. after lines were removed
+void ScriptModule::RelinkBlocks()
+{
+	compiled->beginToEndMap.clear();
+	compiled->endToBeginMap.clear();
+	compiled->loopExitMap.clear();
+	nestStack = {};
+	isCompiling = true;
+	for (curCompileLine = 0; curCompileLine < compiled->scriptRunLines.size(); ++curCompileLine)
+	{
+		for (auto& token : compiled->scriptRunLines[curCompileLine].tokens)
+		{
+			if (auto* function = dynamic_cast<FunctionCallToken*>(token.get()))
+				function->Value()->ValidateCompilation(*this);
+		}
+		LinkLine(curCompileLine);
+	}
+	isCompiling = false;
+}
+
+// Copies what the block maps say about a compiled line into the line itself, so running it looks nothing up
+void ScriptModule::LinkLine(std::size_t line)
+{
+	const auto iter = compiled->endToBeginMap.find(static_cast<int>(line));
+	compiled->scriptRunLines[line].stepsForLoop = iter != compiled->endToBeginMap.end() && iter->second.stepsForLoop;
+}
+
+void ScriptModule::RunLines(std::size_t fromLine, std::size_t toLine)
+{
+	for (curRunLine = fromLine; curRunLine < toLine; curRunLine = nextRunLine)
+	{
+		nextRunLine = curRunLine + 1;
+		auto& line = compiled->scriptRunLines[curRunLine];
+		const auto code = line.Code();
+		statistics.instructions += code.size();
+		TraceScope trace;
+		if (TRACE_ENABLED())
+			trace.Begin(TraceKind::Line, "line", static_cast<std::uint32_t>(SourceLine(curRunLine)));
+		if (line.stepsForLoop)
+			StepForLoop();
+		else
+			EvaluateExpression(code, *this);
+	}
+}
+
+// A module running the same lines with its own position, block state and variables, falling back to this
+// module's variables for reading
+std::unique_ptr<ScriptModule> ScriptModule::CreateFrame()
+{
+	auto frame = CopyCode();
+	frame->outerScope = this;
+	return frame;
+}
+
+// A fresh module running the same lines, sharing them with this module
+std::unique_ptr<ScriptModule> ScriptModule::CopyCode() const
+{
+	auto copy = std::make_unique<ScriptModule>();
+	copy->compiled = compiled;
+	copy->sourceHash = sourceHash;
+	return copy;
+}
+
+// Rough heap footprint of the compiled module, for cache budgets
+std::size_t ScriptModule::MemoryUsage() const
+{
+	// a typical token object with its shared_ptr control block, and a node of the block maps
+	constexpr std::size_t TOKEN_SIZE = 64;
+	constexpr std::size_t MAP_NODE_SIZE = 96;
+	auto numTokens = compiled->code.size();
+	auto size = sizeof(ScriptModule) + sizeof(CompiledScript) + compiled->code.capacity() * sizeof(std::shared_ptr<Token>)
+		+ compiled->scriptRunLines.capacity() * sizeof(ScriptLine) + compiled->lineTable.MemoryUsage();
+	for (const auto& line : compiled->scriptRunLines)
+	{
+		numTokens += line.tokens.size();
+		size += line.tokens.capacity() * sizeof(std::shared_ptr<Token>);
+	}
+	for (const auto& line : scriptCompileLines)
+		size += sizeof(std::string) + line.capacity();
+	return size + numTokens * TOKEN_SIZE + (compiled->beginToEndMap.size() + compiled->endToBeginMap.size() + compiled->loopExitMap.size()) * MAP_NODE_SIZE;
+}
+
+bool ScriptModule::Compile()
+{
+	TraceScope trace;
+	if (TRACE_ENABLED())
+		trace.Begin(TraceKind::Compile, "compile", 0, static_cast<std::uint32_t>(scriptCompileLines.size()));
+	auto lineNum = 0u;
+	try
+	{
+		for (auto iter = scriptCompileLines.begin(); iter != scriptCompileLines.end(); ++iter)
+		{
+			++lineNum;
+			auto& line = *iter;
+			if (line.empty() || IsEmptyString(line))
+				continue;
+			curCompileLine = compiled->scriptRunLines.size();
+			isCompiling = true;
+			compiled->scriptRunLines.emplace_back(ParseStatement(line, *this));
+			LinkLine(curCompileLine);
+			compiled->lineTable.Append({lineNum, static_cast<std::uint32_t>(line.find_first_not_of(" \t") + 1)});
+			sourceHash = HashString(line + '\n', sourceHash);
+		}
+		isCompiling = false;
+		if (!nestStack.empty())
+		{
+			throw ParseError("Begin-type block '" + nestStack.top().name + "' is missing an 'end' specifier", SourceLine(nestStack.top().line));
+		}
+	}
+	catch (const ParseError& e)
+	{
+		isCompiling = false;
+		auto line = lineNum;
+		if (e.line != -1)
+			line = e.line;
+		std::cout << "Syntax error on line " << line << std::endl;
+		std::cout << e.what() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Compiles one more line onto the end of the module; a line that fails to compile leaves the module untouched
+void ScriptModule::CompileLine(const std::string& line)
+{
+	if (!compiled->code.empty())
+		throw ParseError("Can't compile onto a finalized module");
+	scriptCompileLines.push_back(line);
+	const auto lineIndex = compiled->scriptRunLines.size();
+	const auto prevNestStack = nestStack;
+	try
+	{
+		curCompileLine = lineIndex;
+		isCompiling = true;
+		compiled->scriptRunLines.emplace_back(ParseStatement(line, *this));
+		LinkLine(lineIndex);
+		compiled->lineTable.Append({static_cast<std::uint32_t>(scriptCompileLines.size()), static_cast<std::uint32_t>(line.find_first_not_of(" \t") + 1)});
+		isCompiling = false;
+		sourceHash = HashString(line + '\n', sourceHash);
+	}
+	catch (const ParseError&)
+	{
+		isCompiling = false;
+		scriptCompileLines.pop_back();
+		nestStack = prevNestStack;
+		for (auto it = compiled->beginToEndMap.begin(); it != compiled->beginToEndMap.end();)
+		{
+			if (it->second == static_cast<int>(lineIndex))
+				it = compiled->beginToEndMap.erase(it);
+			else
+				++it;
+		}
+		compiled->endToBeginMap.erase(static_cast<int>(lineIndex));
+		compiled->loopExitMap.erase(static_cast<int>(lineIndex));
+		throw;
+	}
+}
+
+void ScriptModule::Execute(std::size_t fromLine)
+{
+	ActiveModuleScope scope(*this);
+	try
+	{
+		if (!isCodeCharged)
+		{
+			Memory().ChargeCode(MemoryUsage());
+			isCodeCharged = true;
+		}
+		RunLines(fromLine, compiled->scriptRunLines.size());
+	}
+	catch (const ParseError& e)
+	{
+		auto line = SourceLine(curRunLine);
+		if (e.line != -1)
+			line = e.line;
+		s_output.Flush();
+		std::cout << "Runtime error on line " << line << std::endl;
+		std::cout << e.what() << std::endl;
+	}
+	catch (const ScriptSuspended&)
+	{
+		// curRunLine is the line of the pending call; Resume runs it again
+	}
+}
+
+// Continues a script whose pending async call has completed
+void ScriptModule::Resume()
+{
+	completedCall = std::move(pendingCall);
+	Execute(curRunLine);
+}
+
+// Executes the script, blocking the thread on every async call
+void ScriptModule::RunToCompletion(std::size_t fromLine)
+{
+	Execute(fromLine);
+	while (IsSuspended())
+	{
+		pendingCall->Wait();
+		Resume();
+	}
+}
+
+// Snapshots hold the execution state only; they are restored onto a module compiled from the same source
+class SnapshotWriter
+{
+public:
+	explicit SnapshotWriter(std::ostream& os) : os(os) {}
+
+	template <typename T>
+	void Write(T value)
+	{
+		os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	void WriteString(std::string_view str)
+	{
+		Write<std::uint32_t>(static_cast<std::uint32_t>(str.size()));
+		os.write(str.data(), static_cast<std::streamsize>(str.size()));
+	}
+
+private:
+	std::ostream& os;
+};
+
+class SnapshotReader
+{
+public:
+	explicit SnapshotReader(std::istream& is) : is(is) {}
+
+	template <typename T>
+	T Read()
+	{
+		T value{};
+		if (!is.read(reinterpret_cast<char*>(&value), sizeof(T)))
+			throw ParseError("Snapshot is truncated");
+		return value;
+	}
+
+	std::string ReadString()
+	{
+		std::string str(Read<std::uint32_t>(), '\0');
+		if (!is.read(&str[0], static_cast<std::streamsize>(str.size())))
+			throw ParseError("Snapshot is truncated");
+		return str;
+	}
+
+private:
+	std::istream& is;
+};
+
+const std::uint32_t SNAPSHOT_MAGIC = 0x50534b6b; // "kKSP"
+const std::uint32_t SNAPSHOT_VERSION = 2;
+
+enum class SnapshotVariableType : std::uint8_t
+{
+	Numeric,
+	String,
+	NumericArray,
+	StringArray,
+};
+
+void ScriptModule::SaveSnapshot(std::ostream& os)
+{
+	// a generator's suspended frame can't be written out
+	if (!generatorLoopStack.empty())
+		throw ParseError("Can't take a snapshot inside a generator loop");
+	SnapshotWriter writer(os);
+	writer.Write(SNAPSHOT_MAGIC);
+	writer.Write(SNAPSHOT_VERSION);
+	writer.Write(sourceHash);
+	writer.Write<std::uint64_t>(nextRunLine);
+
+	// std::stack only exposes its top, so the copy is drained bottom-last and written in reverse
+	std::vector<bool> ifResults;
+	for (auto copy = ifResultStack; !copy.empty(); copy.pop())
+		ifResults.push_back(copy.top());
+	writer.Write<std::uint32_t>(static_cast<std::uint32_t>(ifResults.size()));
+	for (auto iter = ifResults.rbegin(); iter != ifResults.rend(); ++iter)
+		writer.Write<std::uint8_t>(*iter);
+
+	writer.Write<std::uint32_t>(static_cast<std::uint32_t>(forLoopStack.size()));
+	for (auto& loop : forLoopStack)
+	{
+		writer.WriteString(loop.counter->name);
+		writer.Write(loop.last);
+		writer.Write(loop.step);
+		writer.Write<std::uint64_t>(loop.bodyLine);
+	}
+
+	writer.Write<std::uint32_t>(static_cast<std::uint32_t>(scriptVariables.size()));
+	for (auto& [name, variable] : scriptVariables)
+	{
+		if (auto* numVar = dynamic_cast<NumericVariable*>(variable.get()))
+		{
+			writer.Write(SnapshotVariableType::Numeric);
+			writer.WriteString(name);
+			writer.Write(numVar->data);
+		}
+		else if (auto* strVar = dynamic_cast<StringVariable*>(variable.get()))
+		{
+			writer.Write(SnapshotVariableType::String);
+			writer.WriteString(name);
+			writer.WriteString(strVar->data.View());
+		}
+		else if (auto* arrayVar = dynamic_cast<ArrayVariable*>(variable.get()))
+		{
+			writer.Write(arrayVar->isNumeric ? SnapshotVariableType::NumericArray : SnapshotVariableType::StringArray);
+			writer.WriteString(name);
+			writer.Write<std::uint64_t>(arrayVar->Size());
+			if (arrayVar->isNumeric)
+				os.write(reinterpret_cast<const char*>(arrayVar->numbers.data()), static_cast<std::streamsize>(arrayVar->numbers.size() * sizeof(double)));
+			for (auto& str : arrayVar->strings)
+				writer.WriteString(str.View());
+		}
+	}
+}
+
+void ScriptModule::LoadSnapshot(std::istream& is)
+{
+	// restored values are charged to this script
+	ActiveModuleScope scope(*this);
+	SnapshotReader reader(is);
+	if (reader.Read<std::uint32_t>() != SNAPSHOT_MAGIC)
+		throw ParseError("Not a kScript snapshot");
+	if (const auto version = reader.Read<std::uint32_t>(); version != SNAPSHOT_VERSION)
+		throw ParseError("Snapshot format version " + std::to_string(version) + " is not supported (expected " + std::to_string(SNAPSHOT_VERSION) + ")");
+	if (reader.Read<std::uint64_t>() != sourceHash)
+		throw ParseError("Snapshot was taken from a different script");
+	const auto line = reader.Read<std::uint64_t>();
+	if (line > compiled->scriptRunLines.size())
+		throw ParseError("Snapshot line is out of range");
+
+	std::stack<bool, std::vector<bool>> ifResults;
+	for (auto count = reader.Read<std::uint32_t>(); count > 0; --count)
+		ifResults.push(reader.Read<std::uint8_t>() != 0);
+
+	// the counters are tied to their variables once those are read
+	std::vector<std::pair<std::string, ForLoopState>> forLoops;
+	for (auto count = reader.Read<std::uint32_t>(); count > 0; --count)
+	{
+		auto name = reader.ReadString();
+		ForLoopState loop;
+		loop.last = reader.Read<double>();
+		loop.step = reader.Read<double>();
+		loop.bodyLine = reader.Read<std::uint64_t>();
+		forLoops.emplace_back(std::move(name), std::move(loop));
+	}
+
+	std::map<std::string, std::shared_ptr<Variable>, std::less<>> variables;
+	for (auto count = reader.Read<std::uint32_t>(); count > 0; --count)
+	{
+		const auto type = reader.Read<SnapshotVariableType>();
+		auto name = reader.ReadString();
+		switch (type)
+		{
+		case SnapshotVariableType::Numeric:
+			variables[name] = MakePooled<NumericVariable>(name, reader.Read<double>());
+			break;
+		case SnapshotVariableType::String:
+			variables[name] = MakePooled<StringVariable>(name, reader.ReadString());
+			break;
+		case SnapshotVariableType::NumericArray:
+		case SnapshotVariableType::StringArray:
+		{
+			auto array = MakePooled<ArrayVariable>(name);
+			array->isNumeric = type == SnapshotVariableType::NumericArray;
+			const auto size = reader.Read<std::uint64_t>();
+			if (array->isNumeric)
+			{
+				array->numbers.resize(size);
+				if (!is.read(reinterpret_cast<char*>(array->numbers.data()), static_cast<std::streamsize>(size * sizeof(double))))
+					throw ParseError("Snapshot is truncated");
+			}
+			else
+			{
+				for (auto i = 0ull; i < size; ++i)
+					array->strings.push_back(reader.ReadString());
+			}
+			array->ChargeElements();
+			variables[name] = std::move(array);
+			break;
+		}
+		default:
+			throw ParseError("Snapshot contains an unknown variable type");
+		}
+	}
+
+	std::vector<ForLoopState> loops;
+	for (auto& [name, loop] : forLoops)
+	{
+		const auto iter = variables.find(name);
+		loop.counter = iter != variables.end() ? std::dynamic_pointer_cast<NumericVariable>(iter->second) : nullptr;
+		if (!loop.counter)
+			throw ParseError("Snapshot is missing the counter of a 'for' loop");
+		loops.push_back(std::move(loop));
+	}
+
+	nextRunLine = line;
+	ifResultStack = std::move(ifResults);
+	forLoopStack = std::move(loops);
+	scriptVariables = std::move(variables);
+}
+
+class RunOptions
+{
+public:
+	std::string snapshotFileName;
+	// runs the script twice and reports the heap allocations of each run; the second one shows the warm state
+	bool countAllocations = false;
+	// runs the script optimizer after compiling; off for debugging the compiled lines as written
+	bool optimize = true;
+	// bytes each script may hold before it is stopped, 0 for no limit; set, it also reports the peak usage
+	std::size_t memoryLimit = 0;
+	// prints what compiling and running the script took
+	bool report = false;
+	// records trace points while the scripts compile and run, written out as a Chrome trace afterwards
+	std::string traceFileName;
+};
+
+void WriteTraceFile(const std::string& fileName)
+{
+	Tracer::Enable(false);
+	std::ofstream os(fileName);
+	Tracer::WriteChromeTrace(os);
+	if (!os)
+		std::cerr << "Could not write trace file " << fileName << std::endl;
+}
+
+void PrintReport(ScriptModule& scriptModule, std::chrono::steady_clock::duration compileTime,
+	std::chrono::steady_clock::duration executeTime, std::size_t allocations)
+{
+	const auto milliseconds = [](std::chrono::steady_clock::duration duration)
+	{
+		return std::chrono::duration<double, std::milli>(duration).count();
+	};
+	std::cerr << std::fixed << std::setprecision(3)
+		<< "Compile time: " << milliseconds(compileTime) << " ms\n"
+		<< "Execute time: " << milliseconds(executeTime) << " ms\n"
+		<< std::defaultfloat
+		<< "Instructions: " << scriptModule.statistics.instructions << "\n"
+		<< "Loop iterations: " << scriptModule.statistics.loopIterations << "\n"
+		<< "Peak memory: " << scriptModule.Memory().Peak() << " bytes\n"
+		<< "Allocations: " << allocations << "\n"
+		<< "Output bytes: " << s_output.BytesWritten() << std::endl;
+}
+
+void ReportPeakMemory(const std::string& name, ScriptModule& scriptModule)
+{
+	auto& memory = scriptModule.Memory();
+	std::cerr << name << ": peak memory " << memory.Peak() << " of " << memory.Limit() << " bytes" << std::endl;
+}
+
+std::vector<std::string> ReadScriptLines(const std::string& fileName)
+{
+	// blank lines are kept so compile errors count lines like the file does; Compile skips them
+	std::ifstream is(fileName);
+	std::vector<std::string> scriptLines;
+	for (std::string line; std::getline(is, line);)
+		scriptLines.push_back(std::move(line));
+	return scriptLines;
+}
+
+// One numeric expression over named parameters, compiled into a flat program for hosts that evaluate it again and
+// again with different values. Evaluate runs on a fixed-size stack of numbers: no tokens, no variables, no
+// allocations. Constant parts are folded while compiling. Strings, names other than the parameters and functions
+// without a numeric form are rejected when compiling.
+class CompiledExpression
+{
+public:
+	static constexpr std::size_t MAX_STACK_DEPTH = 64;
+	// rows EvaluateColumns runs each instruction over at a time; a chunk of every stack level stays in the L1 cache
+	static constexpr std::size_t COLUMN_CHUNK = 256;
+
+	CompiledExpression(const std::string& expression, std::vector<std::string> paramNames)
+		: paramNames(std::move(paramNames))
+	{
+		ScriptModule scratch;
+		StringIterator iterator(expression);
+		std::size_t depth = 0;
+		for (auto& token : ParseExpression(iterator, scratch))
 		{
-			std::shared_ptr<OperandToken> varToken;
-			if (auto strToken = std::dynamic_pointer_cast<StringConstantToken>(operand); strToken && ((varToken = ParseVariableToken(strToken->Value()))))
+			Instruction instruction;
+			std::size_t numOperands = 0;
+			if (auto* num = dynamic_cast<NumericToken*>(token.get()))
+			{
+				instruction.code = OpCode::Constant;
+				instruction.value = num->Value();
+			}
+			else if (auto* str = dynamic_cast<StringToken*>(token.get()))
 			{
-				// variable
-				stack.push(varToken);
+				const auto param = std::find(this->paramNames.begin(), this->paramNames.end(), str->View());
+				if (param == this->paramNames.end())
+					throw ParseError("'" + std::string(str->View()) + "' is not a parameter of the expression");
+				instruction.code = OpCode::Param;
+				instruction.index = static_cast<std::size_t>(param - this->paramNames.begin());
 			}
-			else
+			else if (auto* op = dynamic_cast<OperatorToken*>(token.get()))
+			{
+				if (auto* dual = dynamic_cast<DualOperandOperator*>(op->Value()))
+				{
+					instruction.code = OpCode::Binary;
+					instruction.binary = FindOperation<DualNumericsOperation>(dual->operations);
+					numOperands = 2;
+				}
+				else if (auto* single = dynamic_cast<SingleOperandOperator*>(op->Value()))
+				{
+					instruction.code = OpCode::Unary;
+					instruction.unary = FindOperation<SingleNumericOperation>(single->operations);
+					numOperands = 1;
+				}
+				if (!instruction.binary && !instruction.unary)
+					throw ParseError("Operator " + op->Value()->operator_ + " can't be used in a compiled expression");
+			}
+			else if (auto* call = dynamic_cast<FunctionCallToken*>(token.get()))
 			{
-				stack.push(operand);
+				if (!call->Value()->HasNumericForm())
+					throw ParseError("Function " + call->Value()->name + " can't be used in a compiled expression");
+				instruction.code = OpCode::Call;
+				instruction.function = call->Value();
+				numOperands = call->Value()->numParams;
 			}
+			if (depth < numOperands)
+				throw ParseError("Not a valid expression");
+			depth = depth - numOperands + 1;
+			if (depth > MAX_STACK_DEPTH)
+				throw ParseError("Expression is too deeply nested");
+			maxDepth = std::max(maxDepth, depth);
+			Append(instruction, numOperands);
 		}
-		else if (auto* operator_ = dynamic_cast<OperatorToken*>(token.get()))
+		if (depth != 1)
+			throw ParseError("Not a valid expression");
+	}
+
+	// args holds a value for every parameter, in the order of the names given when compiling
+	double Evaluate(const double* args) const
+	{
+		double stack[MAX_STACK_DEPTH];
+		std::size_t top = 0;
+		for (const auto& instruction : program)
 		{
-			std::shared_ptr<OperandToken> result;
-			if (stack.size() < operator_->Value()->numOperands)
-				throw ParseError("Invalid number of operands for operator " + std::to_string(operator_->Value()->numOperands));
-			if (auto* op = dynamic_cast<DualOperandOperator*>(operator_->Value()))
+			switch (instruction.code)
 			{
-				auto rhsToken = stack.top();
-				stack.pop();
-				auto lhsToken = stack.top();
-				stack.pop();
-				result = op->Eval(lhsToken.get(), rhsToken.get());
+			case OpCode::Constant:
+				stack[top++] = instruction.value;
+				break;
+			case OpCode::Param:
+				stack[top++] = args[instruction.index];
+				break;
+			case OpCode::Binary:
+				--top;
+				stack[top - 1] = instruction.binary->Apply(stack[top - 1], stack[top]);
+				break;
+			case OpCode::Unary:
+				stack[top - 1] = instruction.unary->Apply(stack[top - 1]);
+				break;
+			case OpCode::Call:
+				top -= instruction.function->numParams;
+				stack[top] = instruction.function->ExecuteNumeric(stack + top);
+				++top;
+				break;
 			}
-			else if (auto* op = dynamic_cast<SingleOperandOperator*>(operator_->Value()))
+		}
+		return stack[0];
+	}
+
+	// Evaluates numRows rows at once; columns holds numRows values for every parameter. Instructions run over a
+	// chunk of rows at a time, so the dispatch is paid per chunk and the operators' loops can use SIMD.
+	void EvaluateColumns(const double* const* columns, std::size_t numRows, double* results) const
+	{
+		std::vector<double> buffers(maxDepth * COLUMN_CHUNK);
+		const auto slot = [&](std::size_t level) { return buffers.data() + level * COLUMN_CHUNK; };
+		const double* stack[MAX_STACK_DEPTH];
+		for (std::size_t start = 0; start < numRows; start += COLUMN_CHUNK)
+		{
+			const auto count = std::min(COLUMN_CHUNK, numRows - start);
+			std::size_t top = 0;
+			for (const auto& instruction : program)
 			{
-				auto token = stack.top();
-				stack.pop();
-				result = op->Eval(token.get());
+				switch (instruction.code)
+				{
+				case OpCode::Constant:
+					std::fill_n(slot(top), count, instruction.value);
+					stack[top] = slot(top);
+					++top;
+					break;
+				case OpCode::Param:
+					// parameters are read straight from their columns
+					stack[top++] = columns[instruction.index] + start;
+					break;
+				case OpCode::Binary:
+					--top;
+					instruction.binary->ApplyColumns(stack[top - 1], stack[top], slot(top - 1), count);
+					stack[top - 1] = slot(top - 1);
+					break;
+				case OpCode::Unary:
+					instruction.unary->ApplyColumn(stack[top - 1], slot(top - 1), count);
+					stack[top - 1] = slot(top - 1);
+					break;
+				case OpCode::Call:
+					top -= instruction.function->numParams;
+					instruction.function->ExecuteNumericColumns(stack + top, slot(top), count);
+					stack[top] = slot(top);
+					++top;
+					break;
+				}
 			}
-			if (!result)
-				throw ParseError("Invalid operands for operator " + operator_->Value()->operator_);
-			stack.push(result);
+			std::copy_n(stack[0], count, results + start);
 		}
-		else if (auto* function = dynamic_cast<FunctionCallToken*>(token.get()))
+	}
+
+	std::size_t NumParams() const
+	{
+		return paramNames.size();
+	}
+
+private:
+	enum class OpCode
+	{
+		Constant,
+		Param,
+		Binary,
+		Unary,
+		Call
+	};
+
+	class Instruction
+	{
+	public:
+		OpCode code = OpCode::Constant;
+		double value = 0;
+		std::size_t index = 0;
+		const DualNumericsOperation* binary = nullptr;
+		const SingleNumericOperation* unary = nullptr;
+		const Function* function = nullptr;
+	};
+
+	std::vector<std::string> paramNames;
+	std::vector<Instruction> program;
+	std::size_t maxDepth = 0;
+
+	template <typename T, typename Operations>
+	static const T* FindOperation(const Operations& operations)
+	{
+		for (auto* operation : operations)
 		{
-			if (stack.size() < function->Value()->numParams)
-				throw ParseError("Invalid number of arguments for function " + function->ToString());
-			std::vector<std::shared_ptr<OperandToken>> params;
-			for (auto i = 0u; i < function->Value()->numParams; ++i)
+			if (auto* numeric = dynamic_cast<const T*>(operation))
+				return numeric;
+		}
+		return nullptr;
+	}
+
+	// Adds the instruction, evaluating it right away if its operands are all constants
+	void Append(const Instruction& instruction, std::size_t numOperands)
+	{
+		program.push_back(instruction);
+		if (instruction.code == OpCode::Constant || instruction.code == OpCode::Param || program.size() <= numOperands || !std::all_of(program.end() - static_cast<std::ptrdiff_t>(numOperands) - 1, program.end() - 1,
+			[](const Instruction& operand) { return operand.code == OpCode::Constant; }))
+			return;
+		double value;
+		try
+		{
+			CompiledExpression folded;
+			folded.program.assign(program.end() - static_cast<std::ptrdiff_t>(numOperands) - 1, program.end());
+			value = folded.Evaluate(nullptr);
+		}
+		catch (const ParseError&)
+		{
+			// left for Evaluate to report
+			return;
+		}
+		program.erase(program.end() - static_cast<std::ptrdiff_t>(numOperands) - 1, program.end());
+		Instruction constant;
+		constant.value = value;
+		program.push_back(constant);
+	}
+
+	CompiledExpression() = default;
+};
+
+// Compiled modules by source text for hosts that compile the same scripts again and again. Lookups take no lock:
+// they search an immutable index that misses replace, and only stamp the entry's last use. A new index shares the
+// buckets it didn't change with the one it replaces, which is freed as soon as the lookups reading it are done.
+// Modules are compiled, optimized and finalized on a miss; once the estimated size of all of them exceeds the
+// budget, the least recently used ones are dropped. Modules handed out stay valid for as long as their holders keep them.
+class ModuleCache
+{
+public:
+	explicit ModuleCache(std::size_t memoryBudget, bool optimize = true)
+		: memoryBudget(memoryBudget), optimize(optimize), currentIndex(std::make_unique<const Index>())
+	{
+		index.store(currentIndex.get());
+	}
+
+	ModuleCache(const ModuleCache&) = delete;
+	ModuleCache& operator=(const ModuleCache&) = delete;
+
+	// nullptr if the source doesn't compile; the errors are reported like for any script
+	std::shared_ptr<const ScriptModule> Get(const std::string& source)
+	{
+		const auto hash = HashString(source);
+		{
+			ReadGuard guard(*this);
+			if (auto scriptModule = Find(guard.Current(), hash, source))
+				return scriptModule;
+		}
+
+		std::lock_guard<std::mutex> lock(writeMutex);
+		const auto& current = *currentIndex;
+		// compiled by another thread while this one waited for the lock
+		if (auto scriptModule = Find(current, hash, source))
+			return scriptModule;
+		auto scriptModule = Compile(source);
+		if (!scriptModule)
+			return nullptr;
+		auto entry = std::make_shared<Entry>(source, scriptModule);
+		entry->lastUse.store(++clock, std::memory_order_relaxed);
+		if (entry->size > memoryBudget)
+			return scriptModule;
+		auto next = std::make_unique<Index>(current);
+		auto& bucket = next->buckets[hash % Index::NUM_BUCKETS];
+		auto added = bucket ? std::make_shared<Bucket>(*bucket) : std::make_shared<Bucket>();
+		next->size += entry->size;
+		++next->numEntries;
+		added->push_back(std::move(entry));
+		bucket = std::move(added);
+		Evict(*next);
+		Publish(std::move(next));
+		return scriptModule;
+	}
+
+	// A runnable instance of a compiled module with its own position, block state and variables
+	static std::unique_ptr<ScriptModule> Instantiate(std::shared_ptr<const ScriptModule> scriptModule)
+	{
+		auto instance = scriptModule->CopyCode();
+		instance->codeOwner = std::move(scriptModule);
+		return instance;
+	}
+
+	std::size_t MemoryUsage() const
+	{
+		ReadGuard guard(*this);
+		return guard.Current().size;
+	}
+
+	std::size_t Size() const
+	{
+		ReadGuard guard(*this);
+		return guard.Current().numEntries;
+	}
+
+private:
+	class Entry
+	{
+	public:
+		std::string source;
+		std::shared_ptr<const ScriptModule> scriptModule;
+		std::size_t size;
+		mutable std::atomic<std::uint64_t> lastUse{0};
+
+		Entry(const std::string& source, std::shared_ptr<const ScriptModule> scriptModule)
+			: source(source), scriptModule(std::move(scriptModule)),
+			  size(sizeof(Entry) + source.capacity() + this->scriptModule->MemoryUsage())
+		{
+		}
+	};
+
+	using Bucket = std::vector<std::shared_ptr<const Entry>>;
+
+	class Index
+	{
+	public:
+		static constexpr std::size_t NUM_BUCKETS = 64;
+
+		// by hash of the source; the source itself tells colliding scripts apart. Null for empty buckets.
+		std::vector<std::shared_ptr<const Bucket>> buckets = std::vector<std::shared_ptr<const Bucket>>(NUM_BUCKETS);
+		std::size_t size = 0;
+		std::size_t numEntries = 0;
+	};
+
+	// Keeps the index a lookup reads alive without taking a lock. Lookups count themselves in the slot of the
+	// current epoch before they load the index; a write that replaces the index moves on to the next epoch and
+	// waits for the lookups still counted in the previous one, which are the only ones that can see the old index.
+	class ReadGuard
+	{
+	public:
+		explicit ReadGuard(const ModuleCache& cache)
+			: cache(cache)
+		{
+			while (true)
 			{
-				params.push_back(stack.top());
-				stack.pop();
+				epoch = cache.epoch.load();
+				cache.numReaders[epoch & 1].fetch_add(1);
+				// a write that moved on in between may already have stopped waiting for this slot
+				if (cache.epoch.load() == epoch)
+					break;
+				cache.numReaders[epoch & 1].fetch_sub(1);
+			}
+			current = cache.index.load();
+		}
+
+		~ReadGuard()
+		{
+			cache.numReaders[epoch & 1].fetch_sub(1);
+		}
+
+		ReadGuard(const ReadGuard&) = delete;
+		ReadGuard& operator=(const ReadGuard&) = delete;
+
+		const Index& Current() const
+		{
+			return *current;
+		}
+
+	private:
+		const ModuleCache& cache;
+		const Index* current;
+		std::uint64_t epoch = 0;
+	};
+
+	std::size_t memoryBudget;
+	bool optimize;
+	// the index lookups read; it's owned below and only touched by writers
+	std::atomic<const Index*> index{nullptr};
+	mutable std::atomic<std::uint64_t> epoch{0};
+	mutable std::atomic<std::size_t> numReaders[2] = {};
+	std::unique_ptr<const Index> currentIndex;
+	std::atomic<std::uint64_t> clock{0};
+	std::mutex writeMutex;
+
+	// Called with writeMutex held. Lookups only search a bucket, so the wait for those that may still read the
+	// replaced index is short, and lookups starting meanwhile don't prolong it.
+	void Publish(std::unique_ptr<const Index> next)
+	{
+		index.store(next.get());
+		// freed on return, once no lookup can read it anymore
+		const auto replaced = std::exchange(currentIndex, std::move(next));
+		const auto previousEpoch = epoch.fetch_add(1);
+		while (numReaders[previousEpoch & 1].load() != 0)
+			std::this_thread::yield();
+	}
+
+	std::shared_ptr<const ScriptModule> Find(const Index& current, std::uint64_t hash, const std::string& source)
+	{
+		const auto& bucket = current.buckets[hash % Index::NUM_BUCKETS];
+		if (!bucket)
+			return nullptr;
+		for (const auto& entry : *bucket)
+		{
+			if (entry->source == source)
+			{
+				entry->lastUse.store(++clock, std::memory_order_relaxed);
+				return entry->scriptModule;
 			}
-			if (!function->Value()->ValidateParams(params))
-				throw ParseError("Wrong parameter types for function " + function->ToString());
-			const auto result = function->Value()->Execute(params, scriptModule);
-			stack.push(Numeric(result));
 		}
+		return nullptr;
 	}
-	if (stack.size() != 1)
+
+	std::shared_ptr<const ScriptModule> Compile(const std::string& source)
 	{
-		throw ParseError("Not a valid expression");
+		std::vector<std::string> lines;
+		std::istringstream is(source);
+		for (std::string line; std::getline(is, line);)
+			lines.push_back(std::move(line));
+		auto scriptModule = std::make_shared<ScriptModule>(std::move(lines));
+		if (!scriptModule->Compile())
+			return nullptr;
+		if (optimize)
+			scriptModule->Optimize();
+		scriptModule->Finalize();
+		return scriptModule;
 	}
-	
-	return stack.top();
-}
 
-bool OperatorOrFunction::Precedes(OperatorOrFunction* other) const
-{
-	if (auto* op = dynamic_cast<Operator*>(other))
+	// Copies the buckets it removes entries from; the others stay shared with the replaced index
+	void Evict(Index& next)
 	{
-		if (op->numOperands == 1)
-			return other->precedence < precedence;
+		while (next.size > memoryBudget)
+		{
+			std::shared_ptr<const Bucket>* oldestBucket = nullptr;
+			std::size_t oldest = 0;
+			for (auto& bucket : next.buckets)
+			{
+				if (!bucket)
+					continue;
+				for (auto i = 0u; i < bucket->size(); ++i)
+				{
+					const auto lastUse = (*bucket)[i]->lastUse.load(std::memory_order_relaxed);
+					if (!oldestBucket || lastUse < (**oldestBucket)[oldest]->lastUse.load(std::memory_order_relaxed))
+					{
+						oldestBucket = &bucket;
+						oldest = i;
+					}
+				}
+			}
+			auto remaining = std::make_shared<Bucket>(**oldestBucket);
+			next.size -= (*remaining)[oldest]->size;
+			--next.numEntries;
+			remaining->erase(remaining->begin() + static_cast<std::ptrdiff_t>(oldest));
+			*oldestBucket = remaining->empty() ? nullptr : std::move(remaining);
+		}
 	}
-	return other->precedence <= precedence;
-}
+};
 
-bool ScriptModule::Compile()
+void ParseFile(const std::string& fileName, const RunOptions& options)
 {
-	auto lineNum = 0u;
-	try
+	const auto compileStart = std::chrono::steady_clock::now();
+	s_scriptModule = ScriptModule(ReadScriptLines(fileName));
+	s_scriptModule.Memory().SetLimit(options.memoryLimit);
+	if (!s_scriptModule.Compile())
+		return;
+	if (options.optimize)
+		s_scriptModule.Optimize();
+	s_scriptModule.Finalize();
+	const auto compileTime = std::chrono::steady_clock::now() - compileStart;
+	std::size_t fromLine = 0;
+	if (!options.snapshotFileName.empty())
 	{
-		for (auto iter = scriptCompileLines.begin(); iter != scriptCompileLines.end(); ++iter)
+		std::ifstream snapshot(options.snapshotFileName, std::ios::binary);
+		try
 		{
-			++lineNum;
-			auto& line = *iter;
-			if (line.empty() || IsEmptyString(line))
-				continue;
-			StringIterator iterator(line);
-			curCompileLineIter = &iter;
-			scriptRunLines.emplace_back(ParseExpression(iterator, *this));
+			if (!snapshot)
+				throw ParseError("Could not open snapshot " + options.snapshotFileName);
+			s_scriptModule.LoadSnapshot(snapshot);
 		}
-		if (!nestStack.empty())
+		catch (const ParseError& e)
 		{
-			throw ParseError("Begin-type block '" + nestStack.top().name + "' is missing an 'end' specifier", nestStack.top().line);
+			std::cout << "Failed to resume: " << e.what() << std::endl;
+			return;
 		}
+		fromLine = s_scriptModule.nextRunLine;
 	}
-	catch (const ParseError& e)
+	if (!options.countAllocations)
 	{
-		auto line = lineNum;
-		if (e.line != -1)
-			line = e.line;
-		std::cout << "Syntax error on line " << line << std::endl;
-		std::cout << e.what() << std::endl;
-		return false;
+		const auto allocationsBefore = t_allocationCount;
+		const auto executeStart = std::chrono::steady_clock::now();
+		s_scriptModule.RunToCompletion(fromLine);
+		const auto executeTime = std::chrono::steady_clock::now() - executeStart;
+		const auto allocations = t_allocationCount - allocationsBefore;
+		s_output.Flush();
+		if (options.memoryLimit)
+			ReportPeakMemory(fileName, s_scriptModule);
+		if (options.report)
+			PrintReport(s_scriptModule, compileTime, executeTime, allocations);
+		return;
+	}
+	for (auto run = 1; run <= 2; ++run)
+	{
+		const auto allocationsBefore = t_allocationCount;
+		s_scriptModule.RunToCompletion(fromLine);
+		s_output.Flush();
+		const auto allocations = t_allocationCount - allocationsBefore;
+		std::cerr << "Run " << run << ": " << allocations << " heap allocations" << std::endl;
 	}
-	return true;
 }
 
-void ScriptModule::Execute()
+// Runs scripts on one thread: while a script waits on an async call, the others run. Completions arrive from the
+// host's threads and queue their script to be resumed.
+class ScriptScheduler
 {
-	int lineNum = 1;
-	try
+public:
+	void Add(ScriptModule& scriptModule)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.push_back(&scriptModule);
+		++numRunning;
+	}
+
+	void Run()
 	{
-		for (auto iter = this->scriptRunLines.begin(); iter != this->scriptRunLines.end(); ++iter)
+		while (numRunning > 0)
 		{
-			lineNum = iter - this->scriptRunLines.begin() + 1;
-			auto& line = *iter;
-			this->curRunLineIter = &iter;
-			EvaluateExpression(line.tokens, *this);
+			ScriptModule* scriptModule;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [this] { return !ready.empty(); });
+				scriptModule = ready.front();
+				ready.pop_front();
+			}
+			{
+				ActiveModuleScope scope(*scriptModule);
+				if (scriptModule->IsSuspended())
+					scriptModule->Resume();
+				else
+					scriptModule->Execute();
+			}
+			if (!scriptModule->IsSuspended())
+			{
+				--numRunning;
+				continue;
+			}
+			scriptModule->pendingCall->OnDone([this, scriptModule]
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					ready.push_back(scriptModule);
+				}
+				wakeUp.notify_one();
+			});
 		}
 	}
-	catch (const ParseError& e)
+
+private:
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<ScriptModule*> ready;
+	std::size_t numRunning = 0;
+};
+
+// Several script files given on the command line run side by side on the main thread; a file given more than once
+// is compiled once
+// Files that can't be read or don't compile are reported and skipped, the others still run; returns false if
+// any was skipped
+bool RunFiles(const std::vector<std::string>& fileNames, const RunOptions& options)
+{
+	constexpr std::size_t CACHE_BUDGET = 64 << 20;
+	ModuleCache cache(CACHE_BUDGET, options.optimize);
+	std::vector<std::pair<std::string, std::unique_ptr<ScriptModule>>> scriptModules;
+	ScriptScheduler scheduler;
+	auto allRun = true;
+	for (const auto& fileName : fileNames)
 	{
-		auto line = lineNum;
-		if (e.line != -1)
-			line = e.line;
-		std::cout << "Runtime error on line " << line << std::endl;
-		std::cout << e.what() << std::endl;
+		std::ifstream is(fileName);
+		if (!is)
+		{
+			std::cout << "Could not open " << fileName << ", skipping it" << std::endl;
+			allRun = false;
+			continue;
+		}
+		std::ostringstream source;
+		source << is.rdbuf();
+		auto compiled = cache.Get(source.str());
+		if (!compiled)
+		{
+			std::cout << fileName << " doesn't compile, skipping it" << std::endl;
+			allRun = false;
+			continue;
+		}
+		auto scriptModule = ModuleCache::Instantiate(std::move(compiled));
+		scriptModule->Memory().SetLimit(options.memoryLimit);
+		scheduler.Add(*scriptModule);
+		scriptModules.emplace_back(fileName, std::move(scriptModule));
 	}
-	
+	scheduler.Run();
+	if (options.memoryLimit)
+	{
+		s_output.Flush();
+		for (const auto& [fileName, scriptModule] : scriptModules)
+			ReportPeakMemory(fileName, *scriptModule);
+	}
+	return allRun;
 }
 
-void ParseFile(const std::string& fileName)
+// '--eval <expression> [<parameter> ...]': evaluates the expression once per line of standard input, which holds
+// the parameters' values separated by whitespace. Lines are read in blocks that are evaluated column-wise.
+void EvaluateRows(const std::string& expression, std::vector<std::string> paramNames)
 {
-	std::ifstream is(fileName);
-	std::vector<std::string> scriptLines;
-	do
+	constexpr std::size_t BLOCK_ROWS = 4096;
+	std::unique_ptr<CompiledExpression> compiled;
+	try
+	{
+		compiled = std::make_unique<CompiledExpression>(expression, std::move(paramNames));
+	}
+	catch (const ParseError& e)
+	{
+		std::cout << "Syntax error: " << e.what() << std::endl;
+		return;
+	}
+	const auto numParams = compiled->NumParams();
+	std::vector<std::vector<double>> columns(numParams, std::vector<double>(BLOCK_ROWS));
+	std::vector<const double*> columnData;
+	for (const auto& column : columns)
+		columnData.push_back(column.data());
+	std::vector<double> results(BLOCK_ROWS);
+	std::size_t firstRow = 1;
+	std::size_t numRows = 0;
+	const auto reportError = [](std::size_t row, const ParseError& e)
+	{
+		s_output.Flush();
+		std::cout << "Runtime error on line " << row << std::endl;
+		std::cout << e.what() << std::endl;
+	};
+	// prints the results of the rows read so far; false after reporting an error
+	const auto evaluateBlock = [&]
+	{
+		std::size_t numResults = numRows;
+		std::unique_ptr<ParseError> error;
+		try
+		{
+			compiled->EvaluateColumns(columnData.data(), numRows, results.data());
+		}
+		catch (const ParseError&)
+		{
+			// evaluated again row by row to find the row that fails
+			std::vector<double> args(numParams);
+			for (numResults = 0; numResults < numRows && !error; ++numResults)
+			{
+				for (auto param = 0u; param < numParams; ++param)
+					args[param] = columns[param][numResults];
+				try
+				{
+					results[numResults] = compiled->Evaluate(args.data());
+				}
+				catch (const ParseError& e)
+				{
+					error = std::make_unique<ParseError>(e);
+				}
+			}
+			--numResults;
+		}
+		for (auto row = 0u; row < numResults; ++row)
+		{
+			char buffer[32];
+			s_output.Write(std::string_view(buffer, FormatNumber(results[row], buffer)), true);
+		}
+		if (error)
+			reportError(firstRow + numResults, *error);
+		firstRow += numRows;
+		numRows = 0;
+		return !error;
+	};
+
+	for (std::string line; std::getline(std::cin, line);)
 	{
-		if (!scriptLines.empty() && IsEmptyString(scriptLines.back()))
-			scriptLines.pop_back();
-		scriptLines.emplace_back();
-	} while (std::getline(is, scriptLines.back()));
-	s_scriptModule = ScriptModule(scriptLines);
-	if (s_scriptModule.Compile())
-		s_scriptModule.Execute();
+		std::size_t numArgs = 0;
+		auto valid = true;
+		ForEachField(line, "", [&](std::string_view field)
+		{
+			valid = numArgs < numParams && ParseNumber(field, columns[numArgs++][numRows]);
+			return valid;
+		});
+		if (!valid || numArgs != numParams)
+		{
+			if (evaluateBlock())
+				reportError(firstRow, ParseError("Expected " + std::to_string(numParams) + " number(s)"));
+			return;
+		}
+		if (++numRows == BLOCK_ROWS && !evaluateBlock())
+			return;
+	}
+	evaluateBlock();
 }
 
+// Lines are compiled onto the global module as they are typed, so variables and compiled code stay live between
+// inputs. A block is executed once its last 'end' has been entered.
 void RunInterpreter()
 {
-	ScriptModule scriptModule;
+	auto& scriptModule = s_scriptModule;
+	auto firstPendingLine = scriptModule.compiled->scriptRunLines.size();
 	std::cout << "kScript Interpreter" << std::endl;
 	while (true)
 	{
-		std::cout << ">> ";
+		std::cout << (scriptModule.nestStack.empty() ? ">> " : ".. ");
 		std::string str;
-		std::getline(std::cin, str);
-		StringIterator iterator(str);
+		if (!std::getline(std::cin, str))
+			break;
+		if (IsEmptyString(str))
+			continue;
 		try
 		{
-			auto tokens = ParseExpression(iterator, scriptModule);
-			auto result = EvaluateExpression(tokens, scriptModule);
-			std::cout << "Result >> " + result->ToString() << std::endl;
+			scriptModule.CompileLine(str);
 		}
 		catch (const ParseError& e)
 		{
 			std::cout << "Syntax error: " << e.what() << std::endl;
+			continue;
+		}
+		if (!scriptModule.nestStack.empty())
+			continue;
+
+		const auto fromLine = firstPendingLine;
+		firstPendingLine = scriptModule.compiled->scriptRunLines.size();
+		if (firstPendingLine - fromLine > 1)
+		{
+			scriptModule.RunToCompletion(fromLine);
+			s_output.Flush();
+			continue;
+		}
+		try
+		{
+			scriptModule.curRunLine = fromLine;
+			scriptModule.nextRunLine = fromLine + 1;
+			std::shared_ptr<OperandToken> result;
+			while (!result)
+			{
+				try
+				{
+					result = EvaluateExpression(scriptModule.compiled->scriptRunLines[fromLine].tokens, scriptModule);
+				}
+				catch (const ScriptSuspended&)
+				{
+					scriptModule.pendingCall->Wait();
+					scriptModule.completedCall = std::move(scriptModule.pendingCall);
+				}
+			}
+			s_output.Flush();
+			std::cout << "Result >> " + result->ToString() << std::endl;
+		}
+		catch (const ParseError& e)
+		{
+			s_output.Flush();
+			std::cout << "Runtime error: " << e.what() << std::endl;
 		}
 	}
 }
 
 int main(int argc, char* argv[])
 {
-	if (argc == 2)
+	std::vector<std::string> args(argv + 1, argv + argc);
+	RunOptions options;
+	while (!args.empty())
+	{
+		if (args.front() == "--async-output")
+		{
+			s_output.UseAsync(stdout, false);
+			args.erase(args.begin());
+		}
+		else if (args.front() == "--count-allocations")
+		{
+			options.countAllocations = true;
+			args.erase(args.begin());
+		}
+		else if (args.front() == "--no-optimize")
+		{
+			options.optimize = false;
+			args.erase(args.begin());
+		}
+		else if (args.front() == "--eval" && args.size() > 1)
+		{
+			EvaluateRows(args[1], std::vector<std::string>(args.begin() + 2, args.end()));
+			s_output.Flush();
+			return 0;
+		}
+		else if (args.front() == "--trace" && args.size() > 1)
+		{
+			options.traceFileName = args[1];
+			args.erase(args.begin(), args.begin() + 2);
+		}
+		else if (args.front() == "--report")
+		{
+			options.report = true;
+			args.erase(args.begin());
+		}
+		else if (args.front() == "--memory-limit" && args.size() > 1)
+		{
+			options.memoryLimit = std::strtoull(args[1].c_str(), nullptr, 10);
+			args.erase(args.begin(), args.begin() + 2);
+		}
+		else if (args.front() == "--resume" && args.size() > 1)
+		{
+			options.snapshotFileName = args[1];
+			args.erase(args.begin(), args.begin() + 2);
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (!options.traceFileName.empty())
+		Tracer::Enable(true);
+	auto status = 0;
+	if (args.size() == 1)
+	{
+		ParseFile(args.front(), options);
+	}
+	else if (args.size() > 1 && options.snapshotFileName.empty() && !options.countAllocations && !options.report)
 	{
-		ParseFile(argv[1]);
+		if (!RunFiles(args, options))
+			status = 1;
 	}
-	else if (argc == 1)
+	else if (args.empty() && options.snapshotFileName.empty())
 	{
 		RunInterpreter();
 	}
 	else
 	{
-		std::cout << "Usage: 'kScript <file>' OR 'kScript' for interactive interpreter";
+		std::cout << "Usage: 'kScript [--async-output] [--count-allocations] [--no-optimize] [--memory-limit <bytes>] [--report] [--trace <json file>] [--resume <snapshot>] <file>' OR 'kScript [--async-output] [--no-optimize] [--memory-limit <bytes>] [--trace <json file>] <file> <file> ...' OR 'kScript --eval <expression> [<parameter> ...]' OR 'kScript' for interactive interpreter";
 	}
+	s_output.Flush();
+	if (!options.traceFileName.empty())
+		WriteTraceFile(options.traceFileName);
+	return status;
 }
@@ -0,0 +1,79 @@
+// Evicts modules from a ModuleCache while other threads keep looking modules up and running them.
+// g++ --std=c++17 -pthread tests/module_cache_test.cpp -o module_cache_test && ./module_cache_test
+#define main kScriptMain
+#include "../main.cpp"
+#undef main
+
+namespace
+{
+	std::string Source(int value)
+	{
+		return "x = " + std::to_string(value) + "\n";
+	}
+
+	bool Runs(ModuleCache& cache, int value)
+	{
+		auto compiled = cache.Get(Source(value));
+		if (!compiled)
+			return false;
+		auto scriptModule = ModuleCache::Instantiate(std::move(compiled));
+		scriptModule->RunToCompletion();
+		auto* x = dynamic_cast<NumericVariable*>(scriptModule->FindVariable("x"));
+		return x && x->data == value;
+	}
+}
+
+int main()
+{
+	constexpr int NUM_READERS = 8;
+	constexpr int NUM_HOT = 4;
+	constexpr int NUM_MISSES = 2000;
+
+	// room for a few modules, so that nearly every miss evicts one
+	const auto moduleSize = ModuleCache(SIZE_MAX).Get(Source(0))->MemoryUsage();
+	const auto budget = 8 * (moduleSize + 256);
+	ModuleCache cache(budget);
+
+	std::atomic<bool> done{false};
+	std::atomic<bool> failed{false};
+	std::vector<std::thread> readers;
+	for (auto r = 0; r < NUM_READERS; ++r)
+	{
+		readers.emplace_back([&, r]
+		{
+			for (auto i = 0; !done.load(); ++i)
+			{
+				if (!Runs(cache, (r + i) % NUM_HOT))
+					failed = true;
+			}
+		});
+	}
+
+	// only this thread looks the missed modules up, so the evicted ones must be freed by the time the miss
+	// that evicted them returns, however many lookups of other modules are running
+	std::vector<std::weak_ptr<const ScriptModule>> missed;
+	std::size_t maxAlive = 0;
+	for (auto i = 0; i < NUM_MISSES; ++i)
+	{
+		const auto value = NUM_HOT + i;
+		if (!Runs(cache, value))
+			failed = true;
+		missed.push_back(cache.Get(Source(value)));
+		std::size_t numAlive = 0;
+		for (const auto& scriptModule : missed)
+			numAlive += !scriptModule.expired();
+		maxAlive = std::max(maxAlive, numAlive > cache.Size() ? numAlive : 0);
+	}
+	done = true;
+	for (auto& reader : readers)
+		reader.join();
+
+	if (failed || maxAlive || cache.MemoryUsage() > budget)
+	{
+		std::cout << "FAIL module_cache_test: up to " << maxAlive << " modules alive with " << cache.Size()
+			<< " cached, " << cache.MemoryUsage() << " bytes" << std::endl;
+		return 1;
+	}
+	std::cout << "PASS module_cache_test" << std::endl;
+	return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# usage: tests/run_tests.sh <kScript binary>
+# Runs every tests/<name>.txt from the tests directory, with the options in <name>.args if there is one, and
+# compares its output with <name>.expected.
+binary=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cd "$(dirname "$0")" || exit 1
+failed=0
+for script in *.txt; do
+	name=${script%.txt}
+	args=$(cat "$name.args" 2>/dev/null)
+	if "$binary" $args "$script" < /dev/null 2>&1 | diff -u "$name.expected" - > /dev/null; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		failed=1
+	fi
+done
+exit $failed